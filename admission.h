@@ -0,0 +1,104 @@
+#ifndef __ADMISSION_TABLE
+#define __ADMISSION_TABLE
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/*
+   Per-source token buckets for the server's handshake path.
+
+   Sources are address prefixes (IPv4 /32 and IPv6 /64 by default) reduced to a 64-bit
+   key by a caller-supplied keyed hash, so a remote host cannot aim its addresses at one
+   bucket set. The table is a fixed array of 4-way sets; a source that is not present
+   takes the way whose bucket was touched longest ago. An evicted source comes back with
+   a full bucket, so the table only needs to be large enough to hold the sources active
+   within one burst window, and memory stays bounded under address-spraying floods.
+
+   Tokens are kept in thousandths so refill needs only integer arithmetic.
+*/
+
+#define ADMISSION_WAYS 4
+#define ADMISSION_SCALE 1000
+
+class AdmissionTable {
+public:
+    // rate: handshakes per second per source; burst: bucket depth in handshakes
+    AdmissionTable(size_t sourceCount, uint32_t rate, uint32_t burst)
+        : perMs(rate), depth((uint64_t)burst * ADMISSION_SCALE) {
+        size_t setCount = 16;
+        while (setCount * ADMISSION_WAYS < sourceCount) setCount <<= 1;
+        buckets.assign(setCount * ADMISSION_WAYS, Bucket());
+        mask = setCount - 1;
+    }
+
+    // Take up to wanted tokens for the source with this key; returns how many it got, 0 when its bucket is empty
+    uint32_t admit(uint64_t key, uint64_t nowMs, uint32_t wanted = 1) {
+        if (key == 0) key = 1; // 0 marks an unused way
+        Bucket *set = &buckets[(key & mask) * ADMISSION_WAYS];
+        Bucket *victim = &set[0];
+
+        for (int way = 0; way < ADMISSION_WAYS; way++) {
+            Bucket &bucket = set[way];
+            if (bucket.key == key) return take(bucket, nowMs, wanted);
+            if (bucket.key == 0 || bucket.lastMs < victim->lastMs) victim = &bucket;
+            if (bucket.key == 0) break;
+        }
+
+        victim->key = key;
+        victim->tokens = depth;
+        victim->lastMs = nowMs;
+        return take(*victim, nowMs, wanted);
+    }
+
+private:
+    struct Bucket {
+        uint64_t key = 0;
+        uint64_t tokens = 0;
+        uint64_t lastMs = 0;
+    };
+
+    uint32_t take(Bucket &bucket, uint64_t nowMs, uint32_t wanted) {
+        uint64_t elapsed = nowMs - bucket.lastMs;
+        bucket.lastMs = nowMs;
+        bucket.tokens += elapsed * perMs; // rate per second == thousandths per ms
+        if (bucket.tokens > depth) bucket.tokens = depth;
+
+        uint64_t granted = bucket.tokens / ADMISSION_SCALE;
+        if (granted > wanted) granted = wanted;
+        bucket.tokens -= granted * ADMISSION_SCALE;
+        return granted;
+    }
+
+    std::vector<Bucket> buckets;
+    size_t mask;
+    uint64_t perMs;
+    uint64_t depth;
+};
+
+// Copy the first prefixBits of the address into prefix (zero padded); returns the byte count
+static inline size_t addressPrefix(const sockaddr_storage &addr, int v4Bits, int v6Bits, uint8_t prefix[17]) {
+    const uint8_t *bytes;
+    int bits;
+
+    memset(prefix, 0, 17);
+    if (addr.ss_family == AF_INET) {
+        bytes = (const uint8_t *)&((const sockaddr_in *)&addr)->sin_addr;
+        bits = v4Bits;
+    } else if (addr.ss_family == AF_INET6) {
+        bytes = (const uint8_t *)&((const sockaddr_in6 *)&addr)->sin6_addr;
+        bits = v6Bits;
+    } else {
+        return 0;
+    }
+
+    prefix[0] = (uint8_t)addr.ss_family;
+    memcpy(prefix + 1, bytes, (bits + 7) / 8);
+    if (bits % 8) prefix[1 + bits / 8] &= (uint8_t)(0xFF << (8 - bits % 8));
+    return 17;
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef __ASSIGNMENT_POOL
+#define __ASSIGNMENT_POOL
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <calcLib.h>
+#include "protocol.h"
+
+/*
+   Per-worker ring of ready-to-send assignment datagrams.
+
+   Entries are generated CALC_POOL_CHUNK at a time by randomAssignments_r(), which
+   also gives the expected answer of each, and get their header (type 1, protocol
+   version) stamped at the same time, so a handshake only copies one entry and writes
+   its ID. The worker tops the ring up with refill() before it goes idle; take()
+   generates a chunk on the spot only when the ring has run dry (available() == 0),
+   which the server counts so the pool can be sized from the metrics.
+
+   Capacity is rounded up to a multiple of the chunk size and the tail only ever
+   advances by whole chunks, so every chunk is contiguous in the arrays.
+*/
+
+#define CALC_POOL_CHUNK 64
+
+class AssignmentPool {
+public:
+    AssignmentPool(size_t capacity, uint16_t majorVersion, uint16_t minorVersion)
+        : head(0), tail(0), major(majorVersion), minor(minorVersion) {
+        size_t chunks = (capacity + CALC_POOL_CHUNK - 1) / CALC_POOL_CHUNK;
+        slotCount = (chunks ? chunks : 1) * CALC_POOL_CHUNK;
+        packets.resize(slotCount);
+        answers.resize(slotCount);
+    }
+
+    // Generate chunks until the ring is full or maxChunks were made; returns chunks made
+    size_t refill(calcRng *rng, size_t maxChunks = (size_t)-1) {
+        size_t made = 0;
+        while (made < maxChunks && slotCount - (tail - head) >= CALC_POOL_CHUNK) {
+            size_t start = tail % slotCount;
+            randomAssignments_r(rng, &packets[start], &answers[start], CALC_POOL_CHUNK);
+            for (size_t i = start; i < start + CALC_POOL_CHUNK; i++) {
+                CalcProtocolWire::Type::store(&packets[i], 1);
+                CalcProtocolWire::MajorVersion::store(&packets[i], major);
+                CalcProtocolWire::MinorVersion::store(&packets[i], minor);
+            }
+            tail += CALC_POOL_CHUNK;
+            made++;
+        }
+        return made;
+    }
+
+    // Slot of the next assignment; valid until the next take() or refill()
+    size_t take(calcRng *rng) {
+        if (head == tail) refill(rng, 1);
+        return head++ % slotCount;
+    }
+
+    const calcProtocol &packet(size_t slot) const { return packets[slot]; }
+    const calcExpected &expected(size_t slot) const { return answers[slot]; }
+
+    size_t available() const { return tail - head; }
+    size_t capacity() const { return slotCount; }
+
+private:
+    std::vector<calcProtocol> packets;
+    std::vector<calcExpected> answers;
+    size_t slotCount;
+    uint64_t head, tail; // Entries taken / generated so far
+    uint16_t major, minor;
+};
+
+#endif
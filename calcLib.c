@@ -9,6 +9,7 @@
    
 */ 
 #include "calcLib.h"
+#include "protocol.h"
 
 
 /* array of char* that points to char arrays.  */ 
@@ -71,3 +72,205 @@ double randomFloat(void){
 };
 
 
+/* 
+   Reentrant generator: xoshiro256** (see https://prng.di.unimi.it/). The state is 4 64-bit words
+   held by the caller, there is no hidden global, so threads do not contend on anything.
+*/
+
+static uint64_t rotl(const uint64_t x, int k){
+  return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t nextRandom(calcRng *rng){
+  uint64_t *s = rng->s;
+  const uint64_t result = rotl(s[1] * 5, 7) * 9;
+  const uint64_t t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+
+  return(result);
+}
+
+/* splitmix64 spreads a small seed over the whole state, as recommended for xoshiro. */
+static uint64_t splitmix64(uint64_t *x){
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return(z ^ (z >> 31));
+}
+
+int initCalcRng_seed(calcRng *rng, unsigned int seed){
+  uint64_t x = seed;
+  int i;
+  for(i = 0; i < 4; i++){
+    rng->s[i] = splitmix64(&x);
+  }
+  return(0);
+}
+
+int initCalcRng(calcRng *rng){
+  /* Mix the clock with the address of the state, so generators set up in the same second still differ. */
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  uint64_t x = ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec) ^ (uint64_t)(uintptr_t)rng;
+  int i;
+  for(i = 0; i < 4; i++){
+    rng->s[i] = splitmix64(&x);
+  }
+  return(0);
+}
+
+char *randomType_r(calcRng *rng){
+  /* 8 operators, so the top 3 bits pick one without any modulo bias. */
+  return(arith[nextRandom(rng) >> 61]);
+}
+
+int randomInt_r(calcRng *rng){
+  /* Multiply-shift maps 32 random bits onto 0..99 without a division. */
+  return((int)(((nextRandom(rng) >> 32) * 100) >> 32));
+}
+
+static double unitDouble(uint64_t r);
+
+double randomFloat_r(calcRng *rng){
+  /* 52 random bits make a double in [0,1), scaled to [0,100). */
+  return(unitDouble(nextRandom(rng)) * 100.0);
+}
+
+
+#define CALC_CHUNK 64
+
+/* 52 random bits as the mantissa of a double in [1,2), minus 1. Integer ops only, so it vectorizes. */
+static double unitDouble(uint64_t r){
+  uint64_t bits = (r >> 12) | 0x3FF0000000000000ULL;
+  double d;
+  memcpy(&d, &bits, sizeof(d));
+  return(d - 1.0);
+}
+
+int randomAssignments_r(calcRng *rng, struct calcProtocol *tasks, calcExpected *expected, int count){
+  uint64_t r0[CALC_CHUNK], r1[CALC_CHUNK], r2[CALC_CHUNK];
+  uint32_t op[CALC_CHUNK];
+  int32_t i1[CALC_CHUNK], i2[CALC_CHUNK], iresult[CALC_CHUNK];
+  double f1[CALC_CHUNK], f2[CALC_CHUNK], fresult[CALC_CHUNK];
+  int done, n, i;
+
+  for(done = 0; done < count; done += n){
+    n = count - done < CALC_CHUNK ? count - done : CALC_CHUNK;
+
+    /* The generator is a serial chain, draw everything for the chunk first... */
+    for(i = 0; i < n; i++){
+      r0[i] = nextRandom(rng);
+      r1[i] = nextRandom(rng);
+      r2[i] = nextRandom(rng);
+    }
+
+    /* ...then every step below is an independent flat loop over the chunk. */
+    for(i = 0; i < n; i++){
+      op[i] = (uint32_t)(r0[i] >> 61) + 1;
+    }
+    for(i = 0; i < n; i++){
+      i1[i] = (int32_t)(((r1[i] >> 32) * 100) >> 32);
+      i2[i] = (int32_t)(((r2[i] >> 32) * 100) >> 32);
+      i2[i] += (i2[i] == 0); /* Only division cares, and 1 is as good a divisor as any */
+    }
+    for(i = 0; i < n; i++){
+      f1[i] = unitDouble(r1[i]) * 100.0;
+      f2[i] = unitDouble(r2[i]) * 100.0;
+      f2[i] += (f2[i] == 0.0);
+    }
+
+    /* Compute every operator and select with masks, no branches. Integer division goes through double,
+       which is exact for 32-bit operands and truncates like C division. */
+    for(i = 0; i < n; i++){
+      int32_t sum = i1[i] + i2[i];
+      int32_t diff = i1[i] - i2[i];
+      int32_t prod = i1[i] * i2[i];
+      int32_t quot = (int32_t)((double)i1[i] / (double)i2[i]);
+      iresult[i] = (sum & -(int32_t)(op[i] == 1)) | (diff & -(int32_t)(op[i] == 2)) |
+                   (prod & -(int32_t)(op[i] == 3)) | (quot & -(int32_t)(op[i] == 4));
+    }
+    for(i = 0; i < n; i++){
+      double fsum = f1[i] + f2[i];
+      double fdiff = f1[i] - f2[i];
+      double fprod = f1[i] * f2[i];
+      double fquot = f1[i] / f2[i];
+      uint64_t bsum, bdiff, bprod, bquot, pick;
+      memcpy(&bsum, &fsum, 8);
+      memcpy(&bdiff, &fdiff, 8);
+      memcpy(&bprod, &fprod, 8);
+      memcpy(&bquot, &fquot, 8);
+      pick = (bsum & -(uint64_t)(op[i] == 5)) | (bdiff & -(uint64_t)(op[i] == 6)) |
+             (bprod & -(uint64_t)(op[i] == 7)) | (bquot & -(uint64_t)(op[i] == 8));
+      memcpy(&fresult[i], &pick, 8);
+    }
+
+    /* Pack into wire format; integer tasks carry zero floats and the other way around. */
+    for(i = 0; i < n; i++){
+      struct calcProtocol *task = &tasks[done + i];
+      calcExpected *answer = &expected[done + i];
+      double netValue;
+
+      memset(task, 0, sizeof(*task));
+      task->arith = htonl(op[i]);
+      answer->arith = op[i];
+      if(op[i] >= 5){
+        convertDoubleToNet(f1[i], &netValue);
+        memcpy(&task->flValue1, &netValue, sizeof(double));
+        convertDoubleToNet(f2[i], &netValue);
+        memcpy(&task->flValue2, &netValue, sizeof(double));
+        answer->inResult = 0;
+        answer->flResult = fresult[i];
+      } else {
+        task->inValue1 = htonl(i1[i]);
+        task->inValue2 = htonl(i2[i]);
+        answer->inResult = iresult[i];
+        answer->flResult = 0.0;
+      }
+    }
+  }
+  return(count);
+}
+
+
+int calcExpectedResult(const struct calcProtocol *task, calcExpected *expected){
+  /* Scalar version of the kernels above, for a task that comes back from the wire. */
+  uint32_t op = ntohl(task->arith);
+  int32_t i1 = (int32_t)ntohl(task->inValue1);
+  int32_t i2 = (int32_t)ntohl(task->inValue2);
+  double netValue, f1, f2;
+
+  memcpy(&netValue, &task->flValue1, sizeof(double));
+  convertDoubleFromNet(netValue, &f1);
+  memcpy(&netValue, &task->flValue2, sizeof(double));
+  convertDoubleFromNet(netValue, &f2);
+
+  expected->arith = op;
+  expected->inResult = 0;
+  expected->flResult = 0.0;
+
+  switch(op){
+  case 1: expected->inResult = i1 + i2; break;
+  case 2: expected->inResult = i1 - i2; break;
+  case 3: expected->inResult = i1 * i2; break;
+  case 4:
+    if(i2 == 0) return(-1);
+    expected->inResult = i1 / i2;
+    break;
+  case 5: expected->flResult = f1 + f2; break;
+  case 6: expected->flResult = f1 - f2; break;
+  case 7: expected->flResult = f1 * f2; break;
+  case 8:
+    if(f2 == 0.0) return(-1);
+    expected->flResult = f1 / f2;
+    break;
+  default:
+    return(-1);
+  }
+  return(0);
+}
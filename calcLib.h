@@ -5,6 +5,8 @@ extern "C"{
 #ifndef __CALC_LIB
 #define __CALC_LIB
 
+#include <stdint.h>
+
 /* 
 
 This is the header file for the calcLib. It is a C library.
@@ -28,6 +30,44 @@ Implementation in calcLib.c
   double randomFloat(void);// Return a random float between 0.0 and 100.0
 
 
+/*
+  Reentrant variants. All generator state lives in a calcRng owned by the caller, so every
+  thread can keep its own and draw numbers without sharing (or locking) anything.
+  Same seed, same sequence - just like initCalcLib_seed(), but per generator.
+*/
+
+  typedef struct calcRng {
+    uint64_t s[4]; // xoshiro256** state, never all zero
+  } calcRng;
+
+  int initCalcRng(calcRng *rng); // Seed from the clock and the generator's address, different per thread.
+  int initCalcRng_seed(calcRng *rng, unsigned int seed); // Seed with <seed>, reproducible sequence.
+
+  char* randomType_r(calcRng *rng); // As randomType(), using <rng>
+  int randomInt_r(calcRng *rng); // As randomInt(), using <rng>
+  double randomFloat_r(calcRng *rng); // As randomFloat(), using <rng>
+
+
+/*
+  Bulk generation. Fills <count> calcProtocol records (see protocol.h) with arith, operands and
+  nothing else, already in network byte order; the caller stamps type, version and id before
+  sending. The answer to each record goes to the matching calcExpected entry, in host order.
+  Division never gets a zero divisor. Work is done in chunks, one flat loop per step, so the
+  compiler can vectorize the conversions and the arithmetic.
+*/
+
+  struct calcProtocol;
+
+  typedef struct calcExpected {
+    uint32_t arith;   // 1-8, host order
+    int32_t inResult; // Answer for arith 1-4
+    double flResult;  // Answer for arith 5-8
+  } calcExpected;
+
+  int randomAssignments_r(calcRng *rng, struct calcProtocol *tasks, calcExpected *expected, int count); // Returns count
+  int calcExpectedResult(const struct calcProtocol *task, calcExpected *expected); // Answer to one wire-format task, -1 if it has none
+
+
 #endif
 
 #ifdef __cplusplus
@@ -0,0 +1,106 @@
+#ifndef __CALC_CLIENT
+#define __CALC_CLIENT
+
+/*
+   Client side of the calc protocol: building the handshake, computing the answer
+   to a decoded assignment and encoding it back (the wire codec is in protocol.h).
+
+   Shared by clientmain.cpp (one exchange per run) and loadgen.cpp (many
+   concurrent virtual clients), so both solve assignments the same way. The helpers
+   taking a `text` flag speak either variant: binary (type 22) or the text lines of
+   textprotocol.h (type 21).
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "protocol.h"
+#include "textprotocol.h"
+
+// Binary (or text) protocol over UDP (17) or TCP (6), version 1.0
+inline calcMessage makeHandshake(bool text = false, uint16_t protocol = 17) {
+    calcMessageHost init = {(uint16_t)(text ? 21 : 22), 0, protocol, 1, 0};
+    calcMessage initMsg;
+    encodeCalcMessage(&initMsg, init);
+    return initMsg;
+}
+
+// Version 1.1 handshake for up to items assignments in one datagram, padded to the size of that
+// datagram (protocol.h); packet needs MULTI_HANDSHAKE_SIZE(items) bytes. Returns the length.
+inline size_t makeMultiHandshake(void *packet, uint32_t items) {
+    calcMessageHost init = {22, items, 17, 1, MULTI_VERSION_MINOR};
+    size_t length = MULTI_HANDSHAKE_SIZE(items);
+    memset(packet, 0, length);
+    encodeCalcMessage(packet, init);
+    return length;
+}
+
+// Operator name for an arith code, NULL if the code is reserved
+inline const char *arithName(uint32_t arith) {
+    return textArithName(arith);
+}
+
+// Returns false for reserved operators and division by zero
+inline bool solveAssignment(const calcProtocolHost &task, int32_t &resultI, double &resultD) {
+    resultI = 0;
+    resultD = 0;
+
+    switch (task.arith) {
+        case 1: resultI = task.inValue1 + task.inValue2; return true;
+        case 2: resultI = task.inValue1 - task.inValue2; return true;
+        case 3: resultI = task.inValue1 * task.inValue2; return true;
+        case 4:
+            if (task.inValue2 == 0) return false;
+            resultI = task.inValue1 / task.inValue2;
+            return true;
+        case 5: resultD = task.flValue1 + task.flValue2; return true;
+        case 6: resultD = task.flValue1 - task.flValue2; return true;
+        case 7: resultD = task.flValue1 * task.flValue2; return true;
+        case 8:
+            if (task.flValue2 == 0) return false;
+            resultD = task.flValue1 / task.flValue2;
+            return true;
+    }
+    return false;
+}
+
+// Encode the answer to task into packet: the assignment echoed back with type 2 and the result
+inline size_t encodeAnswer(void *packet, const calcProtocolHost &task, int32_t resultI, double resultD) {
+    calcProtocolHost answer = task;
+    answer.type = 2;
+    if (task.arith <= 4) {
+        answer.inResult = resultI;
+    } else {
+        answer.flResult = resultD;
+    }
+    return encodeCalcProtocol(packet, answer);
+}
+
+// A text assignment has no header; the handshake settled on version 1.0, so it is filled in as such
+inline bool decodeAssignment(bool text, const void *packet, size_t length, calcProtocolHost &task) {
+    if (!text) return decodeCalcProtocol(packet, length, task);
+    memset(&task, 0, sizeof(task));
+    task.type = 1;
+    task.major_version = 1;
+    return parseTextAssignment((const char *)packet, length, task);
+}
+
+// Answer in the negotiated variant; packet must have room for TEXT_LINE_MAX bytes
+inline size_t encodeAnswer(bool text, void *packet, const calcProtocolHost &task, int32_t resultI, double resultD) {
+    if (!text) return encodeAnswer(packet, task, resultI, resultD);
+    return formatTextAnswer((char *)packet, task.id, task.arith, resultI, resultD);
+}
+
+// calcMessage.message of a verdict (1 = OK, 2 = NOT OK); false if the datagram is not one
+inline bool decodeVerdict(bool text, const void *packet, size_t length, uint32_t &message) {
+    calcMessageHost verdict;
+    if (text) {
+        message = parseTextVerdict((const char *)packet, length);
+        return message != 0;
+    }
+    if (!decodeCalcMessage(packet, length, verdict) || verdict.type != 2) return false;
+    message = verdict.message;
+    return true;
+}
+
+#endif
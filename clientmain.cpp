@@ -3,6 +3,10 @@
 #endif
 
 #include "protocol.h"
+#include "calcclient.h"
+#include "timerwheel.h"
+#include "histogram.h"
+#include "rtoestimator.h"
 
 #include <stdint.h>
 #include <stdio.h>
@@ -13,43 +17,483 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <iostream>
 #include <inttypes.h>
+#include <deque>
+#include <functional>
+#include <queue>
+#include <vector>
 
 #define DEBUG 0
+#define DEFAULT_RETRIES 2     // Retransmissions before a round trip is given up
+#define DEFAULT_MIN_RTO_MS 50 // Floor of the adaptive retransmission timeout
+#define DEFAULT_WINDOW 16 // Exchanges in flight in pipelined mode
+#define STREAM_TIMEOUT_SEC 10 // -T: give up when the server sends nothing for this long
 
 using namespace std;
 
-// Double conversion helpers
-void convertDoubleToNet(double hostVal, double* netVal) {
-    uint64_t temp;
-    memcpy(&temp, &hostVal, sizeof(double));
-    temp = (((uint64_t)htonl(temp & 0xFFFFFFFFULL)) << 32) | htonl(temp >> 32);
-    memcpy(netVal, &temp, sizeof(double));
-}
-
-void convertDoubleFromNet(double netVal, double* hostVal) {
-    uint64_t temp;
-    memcpy(&temp, &netVal, sizeof(double));
-    temp = (((uint64_t)ntohl(temp & 0xFFFFFFFFULL)) << 32) | ntohl(temp >> 32);
-    memcpy(hostVal, &temp, sizeof(double));
-}
-
 // Cleanup helper
 void cleanup(int sockfd, addrinfo* res) {
     if (sockfd >= 0) close(sockfd);
     if (res) freeaddrinfo(res);
 }
 
+struct RetryStats {
+    uint64_t retransmits = 0;
+    uint64_t spurious = 0; // Retransmissions answered faster than any round trip seen: the original was just slow
+    uint64_t stray = 0;    // Datagrams that were not the reply being waited for
+};
+
+// A reply to a retransmitted datagram: Karn's rule forbids a sample, but it may expose a spurious retry
+void noteRetriedReply(const RtoEstimator &rto, RetryStats &stats, uint64_t sinceLastSendUs) {
+    if (rto.minRttUs() > 0 && sinceLastSendUs < rto.minRttUs() / 2) stats.spurious++;
+}
+
+/*
+   Single-shot round trip: send, wait one RTO for a reply, back off and resend until
+   the retry budget is spent. Only a datagram that `expected` accepts ends the wait;
+   anything else (a late duplicate of an earlier reply, a datagram of the wrong size or
+   type) is counted as stray and the wait goes on until the RTO is up. Returns the
+   reply length, or -1 if none came.
+*/
+typedef std::function<bool(const char *reply, size_t length)> ReplyFilter;
+
+ssize_t roundTrip(int sockfd, const addrinfo *server, const void *packet, size_t length, char *buffer, size_t bufferSize,
+                  const ReplyFilter &expected, RtoEstimator &rto, int retries, RetryStats &stats) {
+    for (int attempt = 0; attempt <= retries; attempt++) {
+        if (attempt > 0) stats.retransmits++;
+        uint64_t sentUs = monotonicUs();
+        sendto(sockfd, packet, length, 0, server->ai_addr, server->ai_addrlen);
+
+        uint64_t deadline = sentUs + rto.timeoutUs();
+        for (uint64_t now = sentUs; now < deadline; now = monotonicUs()) {
+            pollfd pfd = {sockfd, POLLIN, 0};
+            if (poll(&pfd, 1, (int)((deadline - now + 999) / 1000)) <= 0) continue;
+
+            ssize_t n = recvfrom(sockfd, buffer, bufferSize, 0, NULL, NULL);
+            if (n < 0) continue;
+            if (!expected(buffer, n)) {
+                stats.stray++;
+                continue;
+            }
+            now = monotonicUs();
+            if (attempt == 0) rto.sample(now - sentUs);
+            else noteRetriedReply(rto, stats, now - sentUs);
+            return n;
+        }
+        rto.backoff();
+    }
+    return -1;
+}
+
+// Send all of a request on the TCP stream, then read exactly one reply frame; returns its size or -1
+ssize_t streamRoundTrip(int sockfd, const void *packet, size_t length, char *buffer, size_t bufferSize) {
+    for (size_t sent = 0; sent < length;) {
+        ssize_t n = send(sockfd, (const char *)packet + sent, length - sent, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        sent += n;
+    }
+
+    size_t have = 0;
+    while (true) {
+        size_t size = streamFrameSize(buffer, have, false);
+        if (size == STREAM_FRAME_INVALID || size > bufferSize) return -1;
+        if (size != 0 && have == size) return size;
+        ssize_t n = recv(sockfd, buffer + have, (size ? size : sizeof(uint16_t)) - have, 0); // Never past this frame
+        if (n <= 0) return -1;
+        have += n;
+    }
+}
+
+/*
+   Pipelined mode (-n/-k): `window` slots run `count` exchanges between them, each slot
+   one exchange at a time on its own connected socket, like loadgen's virtual clients.
+   A slot has a single datagram in flight, so whatever arrives on its socket is the reply
+   to it: an assignment answers the slot's handshake and a verdict the slot's answer.
+   Assignments are also matched on their ID: a copy of one already being answered (the
+   server's reply to a retransmitted handshake) is stray, and a verdict that arrives
+   while the slot waits for an assignment refuses the handshake. Replies to a
+   retransmitted datagram may keep coming after its exchange is over, and a verdict has
+   no ID to tell them apart, so a slot that retransmitted anything starts its next
+   exchange on a fresh socket.
+
+   RTT samples follow Karn's rule per request: every reply to a request that was sent
+   once gives a sample, measured from that request's own send time; a reply to a
+   retransmitted one gives none.
+
+   Retransmission deadlines sit in a min-heap. Entries are never removed early: a
+   deadline whose round trip has completed or been resent since is recognised by its
+   send time and skipped, like the server's timer wheel does with sessions.
+*/
+
+enum SlotState { SLOT_IDLE, SLOT_HANDSHAKE, SLOT_ANSWER };
+
+struct PipelineSlot {
+    int fd;
+    SlotState state = SLOT_IDLE;
+    uint64_t startUs = 0; // First transmission of the handshake, the start of the exchange
+    uint64_t sentUs = 0;  // Latest transmission of the datagram in flight
+    int attempts = 0;
+    bool resent = false; // Something was retransmitted in this exchange, late replies may follow it
+    uint32_t id = 0;     // Assignment being answered, or the last one
+    size_t length = 0;
+    char packet[TEXT_LINE_MAX]; // Answer: binary calcProtocol or a text line
+};
+
+struct RetryDeadline {
+    uint64_t atUs;
+    uint64_t sentUs; // Transmission it was armed for
+    uint32_t slot;
+
+    bool operator>(const RetryDeadline &other) const { return atUs > other.atUs; }
+};
+
+void printLatency(const char *name, const LatencyHistogram &hist) {
+    printf("%-10s n=%-9llu mean=%8.1fus p50=%6lluus p99=%6lluus p999=%6lluus max=%6lluus\n", name,
+           (unsigned long long)hist.count(), hist.mean(),
+           (unsigned long long)hist.percentile(0.50), (unsigned long long)hist.percentile(0.99),
+           (unsigned long long)hist.percentile(0.999), (unsigned long long)hist.max());
+}
+
+int runPipelined(const addrinfo *server, long count, int window, RtoEstimator &rto, int retries, bool text) {
+    uint64_t started = 0, accepted = 0, rejected = 0, refused = 0, unsolvable = 0;
+    uint64_t lost = 0, stray = 0;
+    RetryStats retry;
+    vector<PipelineSlot> slots(window);
+    vector<pollfd> pollfds(window);
+    priority_queue<RetryDeadline, vector<RetryDeadline>, greater<RetryDeadline>> deadlines;
+    LatencyHistogram exchangeUs;
+    calcMessage hello = makeHandshake(text);
+    char buffer[1024];
+
+    // Resolved once; connect() lets every datagram skip the address and drops strays from elsewhere
+    auto openSlot = [&](uint32_t index) {
+        int fd = socket(server->ai_family, server->ai_socktype, server->ai_protocol);
+        if (fd != -1 && connect(fd, server->ai_addr, server->ai_addrlen) == -1) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd == -1) perror("socket");
+        slots[index].fd = fd;
+        pollfds[index] = {fd, POLLIN, 0};
+        return fd != -1;
+    };
+    for (int i = 0; i < window; i++) {
+        if (!openSlot(i)) {
+            for (int j = 0; j < i; j++) close(slots[j].fd);
+            return 1;
+        }
+    }
+
+    auto transmit = [&](uint32_t index, uint64_t now) {
+        PipelineSlot &slot = slots[index];
+        const void *packet = slot.state == SLOT_HANDSHAKE ? (const void *)&hello : slot.packet;
+        size_t length = slot.state == SLOT_HANDSHAKE ? sizeof(hello) : slot.length;
+        if (send(slot.fd, packet, length, 0) == -1) perror("send");
+        slot.sentUs = now;
+        slot.attempts++;
+        deadlines.push({now + rto.timeoutUs(), now, index});
+    };
+    bool failed = false;
+    auto finish = [&](uint32_t index) {
+        PipelineSlot &slot = slots[index];
+        slot.state = SLOT_IDLE;
+        if (!slot.resent) return;
+        close(slot.fd);
+        slot.resent = false;
+        if (!openSlot(index)) failed = true;
+    };
+
+    uint64_t beginUs = monotonicUs(), lastBackoffUs = 0;
+    while (!failed && accepted + rejected + refused + unsolvable + lost < (uint64_t)count) {
+        uint64_t now = monotonicUs();
+        for (uint32_t i = 0; i < slots.size() && started < (uint64_t)count; i++) {
+            if (slots[i].state != SLOT_IDLE) continue;
+            slots[i].state = SLOT_HANDSHAKE;
+            slots[i].startUs = now;
+            slots[i].attempts = 0;
+            transmit(i, now);
+            started++;
+        }
+
+        int waitMs = -1;
+        if (!deadlines.empty()) waitMs = deadlines.top().atUs > now ? (int)((deadlines.top().atUs - now + 999) / 1000) : 0;
+        if (poll(pollfds.data(), pollfds.size(), waitMs) == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        for (size_t i = 0; i < slots.size(); i++) {
+            if (!(pollfds[i].revents & POLLIN)) continue;
+            PipelineSlot &slot = slots[i];
+            ssize_t n;
+            while ((n = recv(slot.fd, buffer, sizeof(buffer), MSG_DONTWAIT)) >= 0) {
+                now = monotonicUs();
+                calcProtocolHost task;
+                uint32_t verdict;
+
+                if (decodeAssignment(text, buffer, n, task)) {
+                    if (slot.state != SLOT_HANDSHAKE || task.id == slot.id) {
+                        stray++; // Reply to a handshake that was already retransmitted and answered
+                        continue;
+                    }
+                    if (slot.attempts > 1) noteRetriedReply(rto, retry, now - slot.sentUs);
+                    else rto.sample(now - slot.sentUs);
+                    slot.id = task.id;
+
+                    int32_t resultI;
+                    double resultD;
+                    if (task.major_version != 1 || task.minor_version != 0 || !solveAssignment(task, resultI, resultD)) {
+                        unsolvable++;
+                        finish(i);
+                        break;
+                    }
+                    slot.state = SLOT_ANSWER;
+                    slot.attempts = 0;
+                    slot.length = encodeAnswer(text, slot.packet, task, resultI, resultD);
+                    transmit(i, now);
+                } else if (decodeVerdict(text, buffer, n, verdict)) {
+                    if (slot.state == SLOT_ANSWER) {
+                        if (slot.attempts > 1) noteRetriedReply(rto, retry, now - slot.sentUs);
+                        else rto.sample(now - slot.sentUs);
+                        exchangeUs.record(now - slot.startUs);
+                        if (verdict == 1) accepted++;
+                        else rejected++;
+                        finish(i);
+                        break;
+                    } else if (slot.state == SLOT_HANDSHAKE) {
+                        refused++;
+                        finish(i);
+                        break;
+                    } else {
+                        stray++;
+                    }
+                } else {
+                    stray++;
+                }
+            }
+        }
+
+        now = monotonicUs();
+        while (!deadlines.empty() && deadlines.top().atUs <= now) {
+            RetryDeadline due = deadlines.top();
+            deadlines.pop();
+
+            PipelineSlot &slot = slots[due.slot];
+            if (slot.state == SLOT_IDLE || slot.sentUs != due.sentUs) continue;
+            if (slot.attempts > retries) {
+                lost++;
+                finish(due.slot);
+                continue;
+            }
+
+            // One doubling per loss event: datagrams armed before the last backoff do not double again
+            if (due.sentUs >= lastBackoffUs) {
+                rto.backoff();
+                lastBackoffUs = now;
+            }
+            retry.retransmits++;
+            slot.resent = true;
+            transmit(due.slot, now);
+        }
+    }
+    double elapsed = (monotonicUs() - beginUs) / 1e6;
+    for (PipelineSlot &slot : slots) {
+        if (slot.fd != -1) close(slot.fd);
+    }
+
+    uint64_t completed = accepted + rejected;
+    printf("Elapsed     %.2f s\n", elapsed);
+    printf("Exchanges   requested=%ld completed=%llu (%.0f/s) window=%d protocol=%s\n", count,
+           (unsigned long long)completed, elapsed > 0 ? completed / elapsed : 0.0, window, text ? "text" : "binary");
+    printf("Verdicts    ok=%llu not-ok=%llu refused=%llu unsolvable=%llu\n", (unsigned long long)accepted,
+           (unsigned long long)rejected, (unsigned long long)refused, (unsigned long long)unsolvable);
+    printf("Loss        lost=%llu retransmits=%llu spurious=%llu stray=%llu\n", (unsigned long long)lost,
+           (unsigned long long)retry.retransmits, (unsigned long long)retry.spurious, (unsigned long long)stray);
+    printf("RTO         srtt=%lluus rttvar=%lluus min-rtt=%lluus rto=%lluus samples=%llu\n", (unsigned long long)rto.srttUs(),
+           (unsigned long long)rto.rttvarUs(), (unsigned long long)rto.minRttUs(), (unsigned long long)rto.currentRtoUs(),
+           (unsigned long long)rto.sampleCount());
+    printLatency("exchange", exchangeUs);
+    return accepted == (uint64_t)count ? 0 : 1;
+}
+
+/*
+   Pipelined mode over TCP (-T -n). The stream is reliable and ordered and the server
+   answers every frame in turn, so each reply belongs to the oldest request still
+   waiting: nothing is retransmitted and nothing has to be guessed. New handshakes and
+   answers are gathered into one send per round; replies are read in bulk and cut into
+   frames by their type field.
+
+   The socket is non-blocking and polled for reading and writing together. The server
+   stops reading a connection whose replies it cannot get rid of (STREAM_OUTPUT_LIMIT),
+   so a client blocked in send() while the replies pile up would deadlock with it; here
+   unsent bytes simply wait in `output` until the socket takes them.
+*/
+struct StreamRequest {
+    uint64_t startUs; // Handshake sent, the start of the exchange
+    bool answer;      // false: waiting for an assignment, true: for a verdict
+};
+
+int runStreamPipelined(int sockfd, long count, int window) {
+    uint64_t started = 0, accepted = 0, rejected = 0, refused = 0, unsolvable = 0;
+    deque<StreamRequest> waiting;
+    LatencyHistogram exchangeUs;
+    calcMessage hello = makeHandshake(false, 6);
+    vector<char> output;
+    vector<char> input(65536);
+    size_t inputLength = 0;
+
+    int flags = fcntl(sockfd, F_GETFL);
+    if (flags == -1 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        return 1;
+    }
+
+    uint64_t beginUs = monotonicUs();
+    while (accepted + rejected + refused + unsolvable < (uint64_t)count) {
+        uint64_t now = monotonicUs();
+        while (started < (uint64_t)count && waiting.size() < (size_t)window) {
+            output.insert(output.end(), (const char *)&hello, (const char *)&hello + sizeof(hello));
+            waiting.push_back({now, false});
+            started++;
+        }
+
+        pollfd pfd = {sockfd, (short)(POLLIN | (output.empty() ? 0 : POLLOUT)), 0};
+        int ready = poll(&pfd, 1, STREAM_TIMEOUT_SEC * 1000);
+        if (ready == -1 && errno == EINTR) continue;
+        if (ready <= 0) {
+            if (ready == 0) fprintf(stderr, "No reply from the server for %d s\n", STREAM_TIMEOUT_SEC);
+            else perror("poll");
+            break;
+        }
+
+        if (pfd.revents & POLLOUT) {
+            ssize_t sent = send(sockfd, output.data(), output.size(), MSG_NOSIGNAL);
+            if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("send");
+                break;
+            }
+            if (sent > 0) output.erase(output.begin(), output.begin() + sent);
+        }
+        if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+        ssize_t n = recv(sockfd, input.data() + inputLength, input.size() - inputLength, 0);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+        if (n <= 0) {
+            if (n == 0) fprintf(stderr, "Connection closed by the server\n");
+            else perror("recv");
+            break;
+        }
+        inputLength += n;
+        now = monotonicUs();
+
+        size_t offset = 0;
+        while (true) {
+            size_t size = streamFrameSize(input.data() + offset, inputLength - offset, false);
+            if (size == STREAM_FRAME_INVALID || (size != 0 && size <= inputLength - offset && waiting.empty())) {
+                fprintf(stderr, "Unexpected data on the stream\n");
+                return 1;
+            }
+            if (size == 0 || size > inputLength - offset) break;
+
+            const char *frame = input.data() + offset;
+            offset += size;
+            StreamRequest request = waiting.front();
+            waiting.pop_front();
+
+            calcProtocolHost task;
+            uint32_t verdict;
+            if (!request.answer && decodeCalcProtocol(frame, size, task)) {
+                int32_t resultI;
+                double resultD;
+                if (task.major_version != 1 || task.minor_version != 0 || !solveAssignment(task, resultI, resultD)) {
+                    unsolvable++;
+                    continue;
+                }
+                char answer[sizeof(calcProtocol)];
+                encodeAnswer(answer, task, resultI, resultD);
+                output.insert(output.end(), answer, answer + sizeof(answer));
+                waiting.push_back({request.startUs, true});
+            } else if (decodeVerdict(false, frame, size, verdict)) {
+                if (!request.answer) {
+                    refused++;
+                    continue;
+                }
+                exchangeUs.record(now - request.startUs);
+                if (verdict == 1) accepted++;
+                else rejected++;
+            } else {
+                fprintf(stderr, "Unexpected data on the stream\n");
+                return 1;
+            }
+        }
+        inputLength -= offset;
+        memmove(input.data(), input.data() + offset, inputLength);
+    }
+    double elapsed = (monotonicUs() - beginUs) / 1e6;
+
+    uint64_t completed = accepted + rejected;
+    printf("Elapsed     %.2f s\n", elapsed);
+    printf("Exchanges   requested=%ld completed=%llu (%.0f/s) window=%d protocol=tcp\n", count,
+           (unsigned long long)completed, elapsed > 0 ? completed / elapsed : 0.0, window);
+    printf("Verdicts    ok=%llu not-ok=%llu refused=%llu unsolvable=%llu\n", (unsigned long long)accepted,
+           (unsigned long long)rejected, (unsigned long long)refused, (unsigned long long)unsolvable);
+    printLatency("exchange", exchangeUs);
+    return accepted == (uint64_t)count ? 0 : 1;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
+    long count = 0; // 0: classic single exchange
+    int window = DEFAULT_WINDOW;
+    int retries = DEFAULT_RETRIES;
+    long minRtoMs = DEFAULT_MIN_RTO_MS;
+    bool text = false;
+    bool tcp = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:k:R:m:tT")) != -1) {
+        switch (opt) {
+        case 'n':
+            count = atol(optarg);
+            break;
+        case 'k':
+            window = atoi(optarg);
+            break;
+        case 'R':
+            retries = atoi(optarg);
+            break;
+        case 'm':
+            minRtoMs = atol(optarg);
+            break;
+        case 't':
+            text = true;
+            break;
+        case 'T':
+            tcp = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t | -T] [-n assignments] [-k window] [-R retries] [-m min_rto_ms] <hostname:port>\n", argv[0]);
+            fprintf(stderr, "  -t              speak the text variant of the protocol (handshake type 21)\n");
+            fprintf(stderr, "  -T              use TCP (protocol 6) instead of UDP; -R and -m do not apply\n");
+            fprintf(stderr, "  -n assignments  run that many exchanges over one socket, then report\n");
+            fprintf(stderr, "  -k window       exchanges in flight with -n (default %d)\n", DEFAULT_WINDOW);
+            fprintf(stderr, "  -R retries      retransmissions before a round trip is given up (default %d)\n", DEFAULT_RETRIES);
+            fprintf(stderr, "  -m ms           lower bound of the adaptive retransmission timeout (default %d)\n", DEFAULT_MIN_RTO_MS);
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1 || count < 0 || window < 1 || retries < 0 || minRtoMs < 1 || (text && tcp)) {
         cout << "ERROR WRONG SIZE OR INCORRECT PROTOCOL" << endl;
         return 1;
     }
 
-    char *hostStr = strtok(argv[1], ":");
+    char *hostStr = strtok(argv[optind], ":");
     char *portToken = strtok(NULL, ":");
     if (!hostStr || !portToken) {
         cout << "ERROR WRONG SIZE OR INCORRECT PROTOCOL" << endl;
@@ -60,7 +504,7 @@ int main(int argc, char *argv[]) {
 
     addrinfo hints{}, *res = nullptr, *cur = nullptr;
     hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_socktype = tcp ? SOCK_STREAM : SOCK_DGRAM;
 
     if (getaddrinfo(hostStr, portToken, &hints, &res) != 0) {
         cout << "ERROR WRONG SIZE OR INCORRECT PROTOCOL" << endl;
@@ -70,7 +514,10 @@ int main(int argc, char *argv[]) {
     int sockfd = -1;
     for (cur = res; cur != nullptr; cur = cur->ai_next) {
         sockfd = socket(cur->ai_family, cur->ai_socktype, cur->ai_protocol);
-        if (sockfd != -1) break;
+        if (sockfd == -1 || !tcp) break;
+        if (connect(sockfd, cur->ai_addr, cur->ai_addrlen) == 0) break;
+        close(sockfd);
+        sockfd = -1;
     }
 
     if (sockfd == -1) {
@@ -79,8 +526,27 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    timeval tv{2, 0};
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    RtoEstimator rto(minRtoMs * 1000);
+    RetryStats retry;
+
+    if (tcp) {
+        timeval timeout = {STREAM_TIMEOUT_SEC, 0};
+        int one = 1;
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    if (count > 0 && tcp) {
+        int status = runStreamPipelined(sockfd, count, window);
+        cleanup(sockfd, res);
+        return status;
+    }
+
+    if (count > 0) {
+        int status = runPipelined(cur, count, window, rto, retries, text);
+        cleanup(sockfd, res);
+        return status;
+    }
 
 #if DEBUG
     sockaddr_in local{};
@@ -91,30 +557,31 @@ int main(int argc, char *argv[]) {
 #endif
 
     // Prepare and send calcMessage
-    calcMessage initMsg = { htons(22), htons(0), htons(17), htons(1), htons(0) };
+    calcMessage initMsg = makeHandshake(text, tcp ? 6 : 17);
     char buffer[1024];
-    ssize_t n;
-    bool gotReply = false;
-    int attempts = 0;
-
-    while (attempts < 3 && !gotReply) {
-        sendto(sockfd, &initMsg, sizeof(initMsg), 0, cur->ai_addr, cur->ai_addrlen);
-        socklen_t addrLen = cur->ai_addrlen;
-        n = recvfrom(sockfd, buffer, sizeof(buffer), 0, cur->ai_addr, &addrLen);
-        if (n >= 0) gotReply = true;
-        else attempts++;
-    }
-
-    if (!gotReply) {
+    auto exchange = [&](const void *packet, size_t length, const ReplyFilter &expected) {
+        if (tcp) return streamRoundTrip(sockfd, packet, length, buffer, sizeof(buffer));
+        return roundTrip(sockfd, cur, packet, length, buffer, sizeof(buffer), expected, rto, retries, retry);
+    };
+
+    // The handshake is answered by an assignment or refused with a calcMessage
+    ssize_t n = exchange(&initMsg, sizeof(initMsg), [text](const char *reply, size_t length) {
+        calcProtocolHost task;
+        calcMessageHost refusal;
+        return decodeAssignment(text, reply, length, task) || decodeCalcMessage(reply, length, refusal) ||
+               (text && parseTextVerdict(reply, length) != 0);
+    });
+
+    if (n < 0) {
         cout << "ERROR WRONG SIZE OR INCORRECT PROTOCOL" << endl;
         cleanup(sockfd, res);
         return 1;
     }
 
-    if (n == sizeof(calcMessage)) {
-        calcMessage failMsg;
-        memcpy(&failMsg, buffer, sizeof(calcMessage));
-        if (ntohs(failMsg.type) == 2 && ntohs(failMsg.message) == 2)
+    uint32_t failMessage = 0;
+    calcMessageHost failMsg;
+    if (decodeVerdict(text, buffer, n, failMessage) || (!text && decodeCalcMessage(buffer, n, failMsg))) {
+        if (failMessage == 2)
             cout << "NOT OK - server does not support protocol" << endl;
         else
             cout << "ERROR WRONG SIZE OR INCORRECT PROTOCOL" << endl;
@@ -122,117 +589,60 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    if (n != sizeof(calcProtocol)) {
+    calcProtocolHost task;
+    if (!decodeAssignment(text, buffer, n, task)) {
         cout << "ERROR WRONG SIZE OR INCORRECT PROTOCOL" << endl;
         cleanup(sockfd, res);
         return 1;
     }
+    uint32_t opCode = task.arith;
 
-    calcProtocol protoPkt;
-    memcpy(&protoPkt, buffer, sizeof(calcProtocol));
-
-    // Unpack fields
-    uint16_t pktType = ntohs(protoPkt.type);
-    uint16_t verMajor = ntohs(protoPkt.major_version);
-    uint16_t verMinor = ntohs(protoPkt.minor_version);
-    uint32_t pktId = ntohl(protoPkt.id);
-    uint32_t opCode = ntohl(protoPkt.arith);
-    int32_t val1 = ntohl(protoPkt.inValue1);
-    int32_t val2 = ntohl(protoPkt.inValue2);
-
-    double dVal1, dVal2, tmp;
-    memcpy(&tmp, &protoPkt.flValue1, sizeof(double));
-    convertDoubleFromNet(tmp, &dVal1);
-    memcpy(&tmp, &protoPkt.flValue2, sizeof(double));
-    convertDoubleFromNet(tmp, &dVal2);
-
-    if (verMajor != 1 || verMinor != 0 || opCode < 1 || opCode > 8) {
+    if (task.major_version != 1 || task.minor_version != 0 || arithName(opCode) == NULL) {
         cout << "ERROR WRONG SIZE OR INCORRECT PROTOCOL" << endl;
         cleanup(sockfd, res);
         return 1;
     }
 
-    string opStr;
-    switch(opCode) {
-        case 1: opStr = "add"; break;
-        case 2: opStr = "sub"; break;
-        case 3: opStr = "mul"; break;
-        case 4: opStr = "div"; break;
-        case 5: opStr = "fadd"; break;
-        case 6: opStr = "fsub"; break;
-        case 7: opStr = "fmul"; break;
-        case 8: opStr = "fdiv"; break;
-    }
-
-    cout << "ASSIGNMENT: " << opStr << " ";
-    if (opCode <= 4) cout << val1 << " " << val2 << endl;
-    else cout << dVal1 << " " << dVal2 << endl;
+    cout << "ASSIGNMENT: " << arithName(opCode) << " ";
+    if (opCode <= 4) cout << task.inValue1 << " " << task.inValue2 << endl;
+    else cout << task.flValue1 << " " << task.flValue2 << endl;
 
     double resultD = 0;
     int32_t resultI = 0;
 
-    if (opCode <= 4) {
-        if (opCode == 4 && val2 == 0) {
-            cout << "ERROR WRONG SIZE OR INCORRECT PROTOCOL" << endl;
-            cleanup(sockfd, res);
-            return 1;
-        }
-        switch(opCode) {
-            case 1: resultI = val1 + val2; break;
-            case 2: resultI = val1 - val2; break;
-            case 3: resultI = val1 * val2; break;
-            case 4: resultI = val1 / val2; break;
-        }
-        protoPkt.inResult = htonl(resultI);
-    } else {
-        if (opCode == 8 && dVal2 == 0) {
-            cout << "ERROR WRONG SIZE OR INCORRECT PROTOCOL" << endl;
-            cleanup(sockfd, res);
-            return 1;
-        }
-        switch(opCode) {
-            case 5: resultD = dVal1 + dVal2; break;
-            case 6: resultD = dVal1 - dVal2; break;
-            case 7: resultD = dVal1 * dVal2; break;
-            case 8: resultD = dVal1 / dVal2; break;
-        }
-        double netD;
-        convertDoubleToNet(resultD, &netD);
-        memcpy(&protoPkt.flResult, &netD, sizeof(double));
+    if (!solveAssignment(task, resultI, resultD)) {
+        cout << "ERROR WRONG SIZE OR INCORRECT PROTOCOL" << endl;
+        cleanup(sockfd, res);
+        return 1;
     }
 
 #if DEBUG
     cerr << "Calculated the result to: " << (opCode <= 4 ? to_string(resultI) : to_string(resultD)) << endl;
 #endif
 
-    // Repack
-    protoPkt.type = htons(pktType);
-    protoPkt.major_version = htons(verMajor);
-    protoPkt.minor_version = htons(verMinor);
-    protoPkt.id = htonl(pktId);
-    protoPkt.arith = htonl(opCode);
+    char answer[TEXT_LINE_MAX];
+    size_t answerLength = encodeAnswer(text, answer, task, resultI, resultD);
 
-    attempts = 0;
-    gotReply = false;
-    while (attempts < 3 && !gotReply) {
-        sendto(sockfd, &protoPkt, sizeof(protoPkt), 0, cur->ai_addr, cur->ai_addrlen);
-        socklen_t addrLen = cur->ai_addrlen;
-        n = recvfrom(sockfd, buffer, sizeof(buffer), 0, cur->ai_addr, &addrLen);
-        if (n >= 0) gotReply = true;
-        else attempts++;
-    }
+    // Verdicts carry no ID, so a verdict is all that can be checked; a second copy of the
+    // assignment (the reply to a retransmitted handshake) is skipped
+    n = exchange(answer, answerLength, [text](const char *reply, size_t length) {
+        uint32_t verdict;
+        return decodeVerdict(text, reply, length, verdict);
+    });
 
-    if (!gotReply || n != sizeof(calcMessage)) {
+#if DEBUG
+    cerr << "Retransmits " << retry.retransmits << ", spurious " << retry.spurious << ", stray " << retry.stray
+         << ", srtt " << rto.srttUs() << "us, rto " << rto.currentRtoUs() << "us" << endl;
+#endif
+
+    uint32_t verdict;
+    if (n < 0 || !decodeVerdict(text, buffer, n, verdict)) {
         cout << "ERROR WRONG SIZE OR INCORRECT PROTOCOL" << endl;
         cleanup(sockfd, res);
         return 1;
     }
 
-    calcMessage finalMsg;
-    memcpy(&finalMsg, buffer, sizeof(calcMessage));
-    uint16_t finalVal = ntohs(finalMsg.message);
-
-    if (finalVal == 0)
+    if (verdict == 1)
         cout << "OK (myresult=" << (opCode <= 4 ? resultI : resultD) << ")" << endl;
     else
         cout << "NOT OK (myresult=" << (opCode <= 4 ? resultI : resultD) << ")" << endl;
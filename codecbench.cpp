@@ -0,0 +1,377 @@
+/*
+   Microbenchmark and self-check for the wire codecs in protocol.h and textprotocol.h.
+
+   Before timing anything it round-trips random messages through encode/decode, in
+   both variants, compares a handshake against its byte layout from the protocol
+   description, checks that a failed multi-assignment send still names every session
+   it held after the copy into a send slot (datagram.h), and exits non-zero if any
+   check fails. It then reports the cost per
+   packet of:
+     - decodeCalcProtocol(): every field of an assignment to host order
+     - the server's answer path: reading only the ID and the result field in place
+     - the old path: memcpy into a packed struct, then ntohl/convertDoubleFromNet per field
+     - encodeCalcMessage(): one verdict into a send buffer
+   and the same client and server steps for the text variant, binary and text side by
+   side, with sscanf/snprintf versions of the text steps for reference.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <vector>
+#include "protocol.h"
+#include "textprotocol.h"
+#include "datagram.h"
+
+using namespace std;
+
+#define PACKET_COUNT 1024 // Distinct packets cycled through, small enough to stay in L1/L2
+#define DEFAULT_ROUNDS 20000
+#define ROUND_TRIPS 100000
+
+static uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t nextRandom(uint64_t &state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static calcProtocolHost randomAssignment(uint64_t &state) {
+    calcProtocolHost task;
+    task.type = nextRandom(state);
+    task.major_version = nextRandom(state);
+    task.minor_version = nextRandom(state);
+    task.id = nextRandom(state);
+    task.arith = nextRandom(state) % 8 + 1;
+    task.inValue1 = nextRandom(state);
+    task.inValue2 = nextRandom(state);
+    task.inResult = nextRandom(state);
+    task.flValue1 = (double)(int64_t)nextRandom(state) / 3.0;
+    task.flValue2 = (double)(int64_t)nextRandom(state) / 7.0;
+    task.flResult = (double)(int64_t)nextRandom(state) / 11.0;
+    return task;
+}
+
+static bool sameAssignment(const calcProtocolHost &a, const calcProtocolHost &b) {
+    return a.type == b.type && a.major_version == b.major_version && a.minor_version == b.minor_version &&
+           a.id == b.id && a.arith == b.arith && a.inValue1 == b.inValue1 && a.inValue2 == b.inValue2 &&
+           a.inResult == b.inResult && memcmp(&a.flValue1, &b.flValue1, sizeof(double)) == 0 &&
+           memcmp(&a.flValue2, &b.flValue2, sizeof(double)) == 0 && memcmp(&a.flResult, &b.flResult, sizeof(double)) == 0;
+}
+
+static bool selfCheck() {
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    char packet[sizeof(calcProtocol)];
+
+    for (int i = 0; i < ROUND_TRIPS; i++) {
+        calcProtocolHost in = randomAssignment(state), out;
+        if (encodeCalcProtocol(packet, in) != sizeof(calcProtocol) ||
+            !decodeCalcProtocol(packet, sizeof(calcProtocol), out) || !sameAssignment(in, out)) {
+            fprintf(stderr, "calcProtocol round trip %d failed\n", i);
+            return false;
+        }
+
+        calcMessageHost msgIn = {(uint16_t)in.type, in.id, (uint16_t)in.arith, in.major_version, in.minor_version}, msgOut;
+        if (encodeCalcMessage(packet, msgIn) != sizeof(calcMessage) ||
+            !decodeCalcMessage(packet, sizeof(calcMessage), msgOut) || msgOut.type != msgIn.type ||
+            msgOut.message != msgIn.message || msgOut.protocol != msgIn.protocol ||
+            msgOut.major_version != msgIn.major_version || msgOut.minor_version != msgIn.minor_version) {
+            fprintf(stderr, "calcMessage round trip %d failed\n", i);
+            return false;
+        }
+    }
+
+    // Client handshake: type 22, message 0, protocol 17, version 1.0, all big endian
+    static const unsigned char handshake[] = {0, 22, 0, 0, 0, 0, 0, 17, 0, 1, 0, 0};
+    calcMessageHost hello = {22, 0, 17, 1, 0};
+    encodeCalcMessage(packet, hello);
+    if (memcmp(packet, handshake, sizeof(handshake)) != 0) {
+        fprintf(stderr, "handshake layout does not match the protocol\n");
+        return false;
+    }
+
+    calcProtocolHost task;
+    if (decodeCalcMessage(packet, sizeof(calcMessage) + 1, hello) || decodeCalcProtocol(packet, sizeof(calcProtocol) - 1, task)) {
+        fprintf(stderr, "decode accepted a datagram of the wrong size\n");
+        return false;
+    }
+    return true;
+}
+
+// Text lines must give back the exact operands and results, doubles bit for bit
+static bool textSelfCheck() {
+    uint64_t state = 0x2545F4914F6CDD1DULL;
+    char line[TEXT_LINE_MAX];
+
+    for (int i = 0; i < ROUND_TRIPS; i++) {
+        calcProtocolHost in = randomAssignment(state), out;
+        size_t length = formatTextAssignment(line, in);
+        if (length == 0 || length > TEXT_LINE_MAX || !isTextDatagram(line, length) || !parseTextAssignment(line, length, out) ||
+            out.id != in.id || out.arith != in.arith ||
+            (in.arith <= 4 ? out.inValue1 != in.inValue1 || out.inValue2 != in.inValue2
+                           : memcmp(&out.flValue1, &in.flValue1, sizeof(double)) != 0 ||
+                                 memcmp(&out.flValue2, &in.flValue2, sizeof(double)) != 0)) {
+            fprintf(stderr, "text assignment round trip %d failed: %.*s", i, (int)length, line);
+            return false;
+        }
+
+        textAnswer answer;
+        length = formatTextAnswer(line, in.id, in.arith, in.inResult, in.flResult);
+        if (!parseTextAnswer(line, length, answer) || answer.id != in.id ||
+            (in.arith <= 4 ? !answer.integral || answer.resultI != in.inResult
+                           : memcmp(&answer.resultD, &in.flResult, sizeof(double)) != 0)) {
+            fprintf(stderr, "text answer round trip %d failed: %.*s", i, (int)length, line);
+            return false;
+        }
+    }
+
+    for (uint32_t code = 1; code <= 2; code++) {
+        size_t length = formatTextVerdict(line, code);
+        if (parseTextVerdict(line, length) != code || isTextDatagram(line, length)) {
+            fprintf(stderr, "text verdict %u round trip failed\n", code);
+            return false;
+        }
+    }
+
+    static const char *const badAssignments[] = {"", "7 mod 1 2", "7 add 1", "7 add 1 2 3", "7 add 1.5 2", "7  add 1 2",
+                                                 "7 fadd 1.5 2\n\n", "-7 add 1 2"};
+    static const char *const badAnswers[] = {"", "x 1", "1  2", "1 2 3", "1 2.5x", "-1 2", "1 2 \n"};
+    calcProtocolHost task;
+    textAnswer answer;
+    for (const char *text : badAssignments) {
+        if (parseTextAssignment(text, strlen(text), task)) {
+            fprintf(stderr, "text parser accepted assignment \"%s\"\n", text);
+            return false;
+        }
+    }
+    for (const char *text : badAnswers) {
+        if (parseTextAnswer(text, strlen(text), answer)) {
+            fprintf(stderr, "text parser accepted answer \"%s\"\n", text);
+            return false;
+        }
+    }
+    return true;
+}
+
+// The server frees the sessions of a datagram whose send failed; a packed one holds one per record
+static bool unsentSelfCheck() {
+    static Datagram out, slot;
+    uint64_t state = 0x5E55105;
+    out.length = 0;
+    out.session = 0;
+    out.packed = true;
+    vector<uint32_t> ids;
+    for (int i = 0; i < MULTI_MAX_ITEMS; i++) {
+        calcProtocolHost task = randomAssignment(state);
+        task.id = 1000 + i;
+        out.length += encodeCalcProtocol(out.data + out.length, task);
+        ids.push_back(task.id);
+    }
+    memset(&slot, 0xA5, sizeof(slot)); // A send slot still holding an earlier, unpacked datagram
+    slot.packed = false;
+    copyDatagram(slot, out);
+
+    vector<uint32_t> released;
+    forEachHeldSession(slot, [&](uint32_t id) { released.push_back(id); });
+    if (released != ids) {
+        fprintf(stderr, "failed packed send released %zu of %zu sessions\n", released.size(), ids.size());
+        return false;
+    }
+
+    out.packed = false;
+    out.session = 77;
+    copyDatagram(slot, out);
+    released.clear();
+    forEachHeldSession(slot, [&](uint32_t id) { released.push_back(id); });
+    if (released.size() != 1 || released[0] != 77) {
+        fprintf(stderr, "failed send released %zu sessions instead of its own\n", released.size());
+        return false;
+    }
+    return true;
+}
+
+// Pre-codec server path: copy into the packed struct, then convert field by field
+static void legacyDecode(const char *packet, calcProtocolHost &out) {
+    calcProtocol raw;
+    memcpy(&raw, packet, sizeof(raw));
+    out.type = ntohs(raw.type);
+    out.major_version = ntohs(raw.major_version);
+    out.minor_version = ntohs(raw.minor_version);
+    out.id = ntohl(raw.id);
+    out.arith = ntohl(raw.arith);
+    out.inValue1 = ntohl(raw.inValue1);
+    out.inValue2 = ntohl(raw.inValue2);
+    out.inResult = ntohl(raw.inResult);
+    convertDoubleFromNet(raw.flValue1, &out.flValue1);
+    convertDoubleFromNet(raw.flValue2, &out.flValue2);
+    convertDoubleFromNet(raw.flResult, &out.flResult);
+}
+
+static void report(const char *name, uint64_t elapsedNs, uint64_t packets, uint64_t sink) {
+    printf("%-28s %7.2f ns/packet  (%llu packets, check %llx)\n", name, (double)elapsedNs / packets,
+           (unsigned long long)packets, (unsigned long long)(sink & 0xFFFF));
+}
+
+int main(int argc, char *argv[]) {
+    int rounds = DEFAULT_ROUNDS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            rounds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n rounds]  (each round decodes %d packets)\n", argv[0], PACKET_COUNT);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (!selfCheck() || !textSelfCheck() || !unsentSelfCheck()) return 1;
+    printf("Round trips OK (%d assignments, %d messages, binary and text)\n", ROUND_TRIPS, ROUND_TRIPS);
+
+    uint64_t state = 12345;
+    vector<char> packets(PACKET_COUNT * sizeof(calcProtocol));
+    for (int i = 0; i < PACKET_COUNT; i++) {
+        calcProtocolHost task = randomAssignment(state);
+        encodeCalcProtocol(&packets[i * sizeof(calcProtocol)], task);
+    }
+
+    uint64_t total = (uint64_t)rounds * PACKET_COUNT;
+    uint64_t sink = 0;
+    uint64_t start = nowNs();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < PACKET_COUNT; i++) {
+            calcProtocolHost task;
+            decodeCalcProtocol(&packets[i * sizeof(calcProtocol)], sizeof(calcProtocol), task);
+            sink += task.id + task.inResult + (uint64_t)task.flResult;
+        }
+    }
+    report("decodeCalcProtocol", nowNs() - start, total, sink);
+
+    sink = 0;
+    start = nowNs();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < PACKET_COUNT; i++) {
+            const char *packet = &packets[i * sizeof(calcProtocol)];
+            sink += CalcProtocolWire::Id::load(packet) + CalcProtocolWire::InResult::load(packet) +
+                    (uint64_t)CalcProtocolWire::FlResult::load(packet);
+        }
+    }
+    report("in-place id + result", nowNs() - start, total, sink);
+
+    sink = 0;
+    start = nowNs();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < PACKET_COUNT; i++) {
+            calcProtocolHost task;
+            legacyDecode(&packets[i * sizeof(calcProtocol)], task);
+            sink += task.id + task.inResult + (uint64_t)task.flResult;
+        }
+    }
+    report("memcpy + per-field swap", nowNs() - start, total, sink);
+
+    vector<char> replies(PACKET_COUNT * sizeof(calcMessage));
+    sink = 0;
+    start = nowNs();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < PACKET_COUNT; i++) {
+            calcMessageHost verdict = {2, (uint32_t)(i & 1) + 1, 17, 1, 0};
+            encodeCalcMessage(&replies[i * sizeof(calcMessage)], verdict);
+        }
+        sink += replies[r % replies.size()];
+    }
+    report("encodeCalcMessage", nowNs() - start, total, sink);
+
+    // Text variant: the same assignments as lines, and a matching answer line for each
+    vector<calcProtocolHost> tasks(PACKET_COUNT);
+    vector<char> lines(PACKET_COUNT * TEXT_LINE_MAX), answerLines(PACKET_COUNT * TEXT_LINE_MAX);
+    vector<size_t> lineLengths(PACKET_COUNT), answerLengths(PACKET_COUNT);
+    for (int i = 0; i < PACKET_COUNT; i++) {
+        decodeCalcProtocol(&packets[i * sizeof(calcProtocol)], sizeof(calcProtocol), tasks[i]);
+        tasks[i].arith = tasks[i].arith % 8 + 1;
+        lineLengths[i] = formatTextAssignment(&lines[i * TEXT_LINE_MAX], tasks[i]);
+        answerLengths[i] = formatTextAnswer(&answerLines[i * TEXT_LINE_MAX], tasks[i].id, tasks[i].arith, tasks[i].inResult, tasks[i].flResult);
+    }
+
+    printf("\nText variant, binary equivalent first:\n");
+    sink = 0;
+    start = nowNs();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < PACKET_COUNT; i++) {
+            sink += encodeCalcProtocol(&packets[i * sizeof(calcProtocol)], tasks[i]);
+        }
+    }
+    report("encodeCalcProtocol", nowNs() - start, total, sink);
+
+    sink = 0;
+    start = nowNs();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < PACKET_COUNT; i++) {
+            sink += formatTextAssignment(&lines[i * TEXT_LINE_MAX], tasks[i]);
+        }
+    }
+    report("formatTextAssignment", nowNs() - start, total, sink);
+
+    sink = 0;
+    start = nowNs();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < PACKET_COUNT; i++) {
+            const calcProtocolHost &task = tasks[i];
+            char *line = &lines[i * TEXT_LINE_MAX];
+            if (task.arith <= 4) {
+                sink += snprintf(line, TEXT_LINE_MAX, "%u %s %d %d\n", task.id, textArithName(task.arith), task.inValue1, task.inValue2);
+            } else {
+                sink += snprintf(line, TEXT_LINE_MAX, "%u %s %.17g %.17g\n", task.id, textArithName(task.arith), task.flValue1, task.flValue2);
+            }
+        }
+    }
+    report("snprintf assignment", nowNs() - start, total, sink);
+
+    for (int i = 0; i < PACKET_COUNT; i++) lineLengths[i] = formatTextAssignment(&lines[i * TEXT_LINE_MAX], tasks[i]);
+
+    sink = 0;
+    start = nowNs();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < PACKET_COUNT; i++) {
+            calcProtocolHost task;
+            parseTextAssignment(&lines[i * TEXT_LINE_MAX], lineLengths[i], task);
+            sink += task.id + task.inValue1 + (uint64_t)task.flValue1;
+        }
+    }
+    report("parseTextAssignment", nowNs() - start, total, sink);
+
+    sink = 0;
+    start = nowNs();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < PACKET_COUNT; i++) {
+            char command[10];
+            uint32_t id;
+            double value1, value2;
+            sscanf(&lines[i * TEXT_LINE_MAX], "%u %9s %lg %lg", &id, command, &value1, &value2);
+            sink += id + (uint64_t)value1;
+        }
+    }
+    report("sscanf assignment", nowNs() - start, total, sink);
+
+    sink = 0;
+    start = nowNs();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < PACKET_COUNT; i++) {
+            textAnswer answer;
+            parseTextAnswer(&answerLines[i * TEXT_LINE_MAX], answerLengths[i], answer);
+            sink += answer.id + answer.resultI + (uint64_t)answer.resultD;
+        }
+    }
+    report("parseTextAnswer", nowNs() - start, total, sink);
+
+    return 0;
+}
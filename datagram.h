@@ -0,0 +1,59 @@
+#ifndef __DATAGRAM
+#define __DATAGRAM
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "protocol.h"
+
+/*
+   The server's unit of queued UDP output, kept in a header of its own so the
+   bookkeeping that decides which sessions an unsent datagram still holds can be
+   checked by codecbench without a running server.
+
+   An outgoing assignment holds the session it was issued for, or with packed set,
+   one session per record (a version 1.1 multi-assignment datagram). If the send
+   fails no client is waiting on any of them, and forEachHeldSession() names every
+   one so the server can free them at once. Every copy of a datagram, such as the
+   io_uring send slots, goes through copyDatagram() so those fields travel with it.
+*/
+
+#define MAXBUFLEN 1472 // Largest UDP payload in a 1500-byte MTU, room for a full multi-assignment datagram
+
+// A datagram with its peer address: a reply waiting to be flushed by sendto (per-packet path)
+// or sendmmsg (batched path), or a response handed over to the shard that owns its ID
+struct Datagram {
+    sockaddr_storage addr;
+    socklen_t addrLen;
+    size_t length;
+    int listener; // Listen address it arrived on, for datagrams in a mailbox
+    uint32_t session; // Session an outgoing assignment belongs to, released if the send fails; 0 otherwise
+    bool packed; // Outgoing version 1.1 assignments: every record in data has a session of its own
+    char data[MAXBUFLEN];
+};
+
+// Only the used part of data is copied
+static inline void copyDatagram(Datagram &to, const Datagram &from) {
+    to.addr = from.addr;
+    to.addrLen = from.addrLen;
+    to.length = from.length;
+    to.listener = from.listener;
+    to.session = from.session;
+    to.packed = from.packed;
+    memcpy(to.data, from.data, from.length);
+}
+
+// Call visit(id) for each session the datagram was sent on behalf of
+template <typename Visit>
+static inline void forEachHeldSession(const Datagram &out, Visit visit) {
+    if (out.packed) {
+        for (size_t offset = 0; offset + CalcProtocolWire::size <= out.length; offset += CalcProtocolWire::size) {
+            visit(CalcProtocolWire::Id::load(out.data + offset));
+        }
+    } else if (out.session != 0) {
+        visit(out.session);
+    }
+}
+
+#endif
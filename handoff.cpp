@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "handoff.h"
+
+using namespace std;
+
+struct HandoffHeader {
+    uint64_t payloadLength;
+    uint32_t fdCount;
+};
+
+static bool handoffAddress(const char *path, sockaddr_un &addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    return true;
+}
+
+static size_t markerCount(uint32_t fdCount) {
+    return fdCount > HANDOFF_FDS_PER_MESSAGE ? (fdCount - 1) / HANDOFF_FDS_PER_MESSAGE : 0;
+}
+
+bool handoffBlocking(int fd, int timeoutSec) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1) return false;
+
+    struct timeval timeout = {timeoutSec, 0};
+    return setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0 &&
+           setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == 0;
+}
+
+int handoffListen(const char *path) {
+    sockaddr_un addr;
+    if (!handoffAddress(path, addr)) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    unlink(path); // Left behind by a server that did not shut down cleanly, or already handed over
+    if (bind(fd, (const sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 1) == -1) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+int handoffAccept(int listener) {
+    return accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+int handoffConnect(const char *path) {
+    sockaddr_un addr;
+    if (!handoffAddress(path, addr)) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (const sockaddr *)&addr, sizeof(addr)) == -1) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    handoffBlocking(fd, HANDOFF_TIMEOUT_SEC);
+    return fd;
+}
+
+// One sendmsg: bytes, with up to HANDOFF_FDS_PER_MESSAGE descriptors attached to them
+static bool sendWithFds(int fd, const void *bytes, size_t length, const int *fds, size_t fdCount) {
+    char control[CMSG_SPACE(HANDOFF_FDS_PER_MESSAGE * sizeof(int))];
+    iovec iov = {(void *)bytes, length};
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fdCount > 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(fdCount * sizeof(int));
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fdCount * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, fdCount * sizeof(int));
+    }
+
+    // A stream socket may take part of the bytes; the descriptors went with the first of them
+    while (length > 0) {
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        iov.iov_base = (char *)iov.iov_base + sent;
+        iov.iov_len = length -= sent;
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+    }
+    return true;
+}
+
+// One recvmsg of up to length bytes, keeping every descriptor that comes along; -1 with
+// errno set on error (ECONNRESET when the peer has gone), otherwise the bytes read
+static ssize_t receiveSome(int fd, void *bytes, size_t length, vector<int> &fds) {
+    char control[CMSG_SPACE(HANDOFF_FDS_PER_MESSAGE * sizeof(int))];
+    iovec iov = {bytes, length};
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) return -1;
+    if (n == 0 && length > 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const int *passed = (const int *)CMSG_DATA(cmsg);
+        fds.insert(fds.end(), passed, passed + count);
+    }
+    if (msg.msg_flags & MSG_CTRUNC) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return n;
+}
+
+// Read exactly length bytes, keeping every descriptor that comes along
+static bool receiveWithFds(int fd, void *bytes, size_t length, vector<int> &fds) {
+    for (size_t received = 0; received < length;) {
+        ssize_t n = receiveSome(fd, (char *)bytes + received, length - received, fds);
+        if (n == -1) return false;
+        received += n;
+    }
+    return true;
+}
+
+bool handoffSend(int fd, const vector<int> &fds, const vector<char> &payload) {
+    HandoffHeader header = {payload.size(), (uint32_t)fds.size()};
+    size_t first = fds.size() < HANDOFF_FDS_PER_MESSAGE ? fds.size() : HANDOFF_FDS_PER_MESSAGE;
+    if (!sendWithFds(fd, &header, sizeof(header), fds.data(), first)) return false;
+
+    for (size_t next = first; next < fds.size(); next += HANDOFF_FDS_PER_MESSAGE) {
+        size_t count = fds.size() - next < HANDOFF_FDS_PER_MESSAGE ? fds.size() - next : HANDOFF_FDS_PER_MESSAGE;
+        char marker = 0;
+        if (!sendWithFds(fd, &marker, 1, fds.data() + next, count)) return false;
+    }
+    return payload.empty() || sendWithFds(fd, payload.data(), payload.size(), NULL, 0);
+}
+
+bool handoffReceive(int fd, vector<int> &fds, vector<char> &payload) {
+    HandoffHeader header;
+    fds.clear();
+    if (!receiveWithFds(fd, &header, sizeof(header), fds)) return false;
+
+    vector<char> marker(markerCount(header.fdCount));
+    payload.resize(header.payloadLength);
+    if (!receiveWithFds(fd, marker.data(), marker.size(), fds) || !receiveWithFds(fd, payload.data(), payload.size(), fds)) {
+        return false;
+    }
+    if (fds.size() != header.fdCount) {
+        for (int passed : fds) close(passed);
+        fds.clear();
+        errno = EPROTO;
+        return false;
+    }
+    return true;
+}
+
+HandoffInbox::~HandoffInbox() {
+    for (int passed : fds) close(passed);
+}
+
+void HandoffInbox::reset() {
+    for (int passed : fds) close(passed);
+    fds.clear();
+    payload.clear();
+    message.clear();
+}
+
+int HandoffInbox::receive(int fd, uint32_t maxFds, size_t maxPayload) {
+    while (true) {
+        size_t expected = sizeof(HandoffHeader);
+        if (message.size() >= sizeof(HandoffHeader)) {
+            HandoffHeader header;
+            memcpy(&header, message.data(), sizeof(header));
+            if (header.fdCount > maxFds || header.payloadLength > maxPayload) {
+                errno = EMSGSIZE;
+                return -1;
+            }
+            expected += markerCount(header.fdCount) + header.payloadLength;
+            if (message.size() == expected) {
+                if (fds.size() != header.fdCount) {
+                    errno = EPROTO;
+                    return -1;
+                }
+                payload.assign(message.end() - header.payloadLength, message.end());
+                return 1;
+            }
+        }
+
+        size_t received = message.size();
+        message.resize(expected);
+        ssize_t n = receiveSome(fd, message.data() + received, expected - received, fds);
+        message.resize(received + (n > 0 ? n : 0));
+        if (n == -1) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+}
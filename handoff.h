@@ -0,0 +1,96 @@
+#ifndef __SERVER_HANDOFF
+#define __SERVER_HANDOFF
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+
+/*
+   Hot restart transport (-H). A running server listens on a Unix stream socket; a new
+   server process started with the same path connects to it and takes over. A message
+   is a payload plus any number of descriptors, passed with SCM_RIGHTS, so the receiver
+   gets its own references to the very same sockets: datagrams that arrive while they
+   change hands simply wait in the receive queues.
+
+   On the stream a message is a header (payload length, descriptor count) carrying the
+   first HANDOFF_FDS_PER_MESSAGE descriptors, one marker byte per further batch of
+   descriptors, then the payload. The reader collects descriptors from every control
+   message it meets, so it does not depend on how the kernel splits the reads.
+
+   Payloads are built with HandoffWriter and read with HandoffReader. Fields are copied
+   in host byte order: both ends are builds of this server on the same machine.
+*/
+
+#define HANDOFF_TIMEOUT_SEC 10 // Longest either side waits for the other per send or receive
+#define HANDOFF_DRAIN_TIMEOUT_SEC 60 // Longest the new server waits for the old one's workers to stop and send the snapshot
+#define HANDOFF_FDS_PER_MESSAGE 64 // Below the kernel's SCM_MAX_FD of 253
+
+int handoffListen(const char *path); // Non-blocking listener at path, replacing a stale socket file; -1 on error
+int handoffAccept(int listener); // Next waiting peer, non-blocking (HandoffInbox); -1 when there is none
+int handoffConnect(const char *path); // Blocking with the handoff timeouts; -1 with errno ENOENT or ECONNREFUSED when no server listens at path
+bool handoffBlocking(int fd, int timeoutSec); // Switch an accepted peer to blocking calls that give up after timeoutSec
+
+// On a blocking socket both wait at most its timeout per call; false with errno set on failure.
+// Received descriptors are close-on-exec.
+bool handoffSend(int fd, const std::vector<int> &fds, const std::vector<char> &payload);
+bool handoffReceive(int fd, std::vector<int> &fds, std::vector<char> &payload);
+
+// handoffReceive for a non-blocking socket, so an event loop can read a peer while it
+// serves: call receive() whenever the socket is readable. It returns 1 once a whole
+// message is in fds and payload, 0 while more is to come, -1 with errno set on error or
+// when the peer announces more than maxFds descriptors or maxPayload bytes. Descriptors
+// still held are closed by reset() and the destructor.
+class HandoffInbox {
+public:
+    std::vector<int> fds;
+    std::vector<char> payload;
+
+    HandoffInbox() {}
+    HandoffInbox(const HandoffInbox &) = delete;
+    HandoffInbox &operator=(const HandoffInbox &) = delete;
+    ~HandoffInbox();
+
+    int receive(int fd, uint32_t maxFds, size_t maxPayload);
+    void reset(); // Ready for the next message
+
+private:
+    std::vector<char> message; // Header, markers and payload as far as they have arrived
+};
+
+struct HandoffWriter {
+    std::vector<char> data;
+
+    void put(const void *bytes, size_t length) {
+        data.insert(data.end(), (const char *)bytes, (const char *)bytes + length);
+    }
+    template <typename T>
+    void put(const T &value) { put(&value, sizeof(value)); }
+};
+
+// Reading past the end yields zeros and clears ok, so a short payload is caught by one check at the end
+struct HandoffReader {
+    const std::vector<char> &data;
+    size_t offset = 0;
+    bool ok = true;
+
+    explicit HandoffReader(const std::vector<char> &payload) : data(payload) {}
+
+    void get(void *bytes, size_t length) {
+        if (!ok || data.size() - offset < length) {
+            ok = false;
+            memset(bytes, 0, length);
+            return;
+        }
+        memcpy(bytes, data.data() + offset, length);
+        offset += length;
+    }
+    template <typename T>
+    T get() {
+        T value;
+        get(&value, sizeof(value));
+        return value;
+    }
+};
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef __LATENCY_HISTOGRAM
+#define __LATENCY_HISTOGRAM
+
+#include <stdint.h>
+#include <atomic>
+
+/*
+   Log-linear (HDR style) latency histogram.
+
+   Values below 2^HIST_SUB_BITS get a bucket each; above that every power of two is
+   split into 2^HIST_SUB_BITS equal buckets, so any recorded value is off by at most
+   1/32 of itself. Fixed size, no allocation.
+
+   One thread records, any thread may read: buckets are relaxed atomics updated with
+   load+store rather than a locked add, which compiles to a plain increment.
+*/
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40 // Values are clamped to 2^40 (about 18 minutes in microseconds)
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+class LatencyHistogram {
+public:
+    LatencyHistogram() { reset(); }
+
+    void reset() {
+        for (int i = 0; i < HIST_BUCKETS; i++) buckets[i].store(0, std::memory_order_relaxed);
+        total.store(0, std::memory_order_relaxed);
+        sum.store(0, std::memory_order_relaxed);
+        maximum.store(0, std::memory_order_relaxed);
+    }
+
+    void record(uint64_t value) {
+        bump(buckets[bucketFor(value)], 1);
+        bump(total, 1);
+        bump(sum, value);
+        if (value > maximum.load(std::memory_order_relaxed)) maximum.store(value, std::memory_order_relaxed);
+    }
+
+    // Add another histogram's counts into this one (reporting side only)
+    void merge(const LatencyHistogram &other) {
+        for (int i = 0; i < HIST_BUCKETS; i++) bump(buckets[i], other.buckets[i].load(std::memory_order_relaxed));
+        bump(total, other.count());
+        bump(sum, other.sum.load(std::memory_order_relaxed));
+        if (other.max() > max()) maximum.store(other.max(), std::memory_order_relaxed);
+    }
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t max() const { return maximum.load(std::memory_order_relaxed); }
+    uint64_t totalSum() const { return sum.load(std::memory_order_relaxed); }
+    double mean() const { return count() ? (double)totalSum() / count() : 0; }
+    uint64_t bucketCount(int bucket) const { return buckets[bucket].load(std::memory_order_relaxed); }
+
+    // Value at quantile q (0..1), reported as the upper edge of its bucket
+    uint64_t percentile(double q) const {
+        uint64_t n = count();
+        if (n == 0) return 0;
+
+        uint64_t rank = (uint64_t)(q * n);
+        if (rank >= n) rank = n - 1;
+
+        uint64_t seen = 0;
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            seen += bucketCount(i);
+            if (seen > rank) {
+                uint64_t edge = bucketUpperEdge(i);
+                return edge < max() ? edge : max();
+            }
+        }
+        return max();
+    }
+
+    static int bucketFor(uint64_t value) {
+        if (value >= (1ULL << HIST_MAX_BITS)) value = (1ULL << HIST_MAX_BITS) - 1;
+        if (value < HIST_SUB_COUNT) return (int)value;
+
+        int exponent = 63 - __builtin_clzll(value); // >= HIST_SUB_BITS
+        int shift = exponent - HIST_SUB_BITS;
+        int sub = (int)(value >> shift) - HIST_SUB_COUNT;
+        return (shift + 1) * HIST_SUB_COUNT + sub;
+    }
+
+    static uint64_t bucketUpperEdge(int bucket) {
+        if (bucket < HIST_SUB_COUNT) return bucket;
+        int shift = bucket / HIST_SUB_COUNT - 1;
+        uint64_t sub = bucket % HIST_SUB_COUNT + HIST_SUB_COUNT;
+        return ((sub + 1) << shift) - 1;
+    }
+
+private:
+    static void bump(std::atomic<uint64_t> &counter, uint64_t amount) {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> buckets[HIST_BUCKETS];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> maximum;
+};
+
+#endif
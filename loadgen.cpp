@@ -0,0 +1,430 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <vector>
+#include <thread>
+#include <string>
+#include "protocol.h"
+#include "calcclient.h"
+#include "timerwheel.h"
+#include "histogram.h"
+
+/*
+   Load generator for the calc server.
+
+   Drives many virtual clients from a few threads. Every virtual client has its own
+   non-blocking UDP socket (so the server sees a distinct peer) and runs the same
+   handshake -> assignment -> answer -> verdict exchange as clientmain.cpp, using the
+   shared code in calcclient.h. Threads multiplex their clients with epoll and keep
+   retransmission deadlines in a timer wheel. With -k above 1 the exchange is the
+   version 1.1 one: a handshake asks for k assignments, they arrive and are answered
+   in one datagram each way, and the verdict carries one bit per assignment.
+
+   A client whose exchange needed a retransmission moves to a fresh socket before
+   its next one: a late duplicate assignment or verdict for the old exchange could
+   otherwise be taken for the reply to the new one.
+
+   Reports throughput, verdicts, loss, retransmissions and a latency histogram for
+   each of the two round trips.
+*/
+
+using namespace std;
+
+#define MAXBUFLEN 1472
+#define DEFAULT_THREADS 2
+#define DEFAULT_CONCURRENCY 1000
+#define DEFAULT_DURATION_SEC 10
+#define DEFAULT_TIMEOUT_MS 500
+#define DEFAULT_RETRIES 3
+#define EPOLL_BATCH 256
+
+enum VirtualClientState { VC_IDLE, VC_HANDSHAKE, VC_ANSWER };
+
+struct VirtualClient {
+    int fd;
+    VirtualClientState state;
+    int attempts;
+    bool resent; // Some transmission of this exchange was repeated, duplicates of its replies may still arrive
+    uint64_t sentAt;   // Microseconds, first transmission of the current round trip
+    uint64_t deadline; // Milliseconds, when to retransmit
+    size_t answerLength;
+    size_t items; // Assignments being answered
+    char answer[MULTI_MAX_ITEMS * sizeof(calcProtocol)];
+};
+
+struct LoadStats {
+    uint64_t started = 0;
+    uint64_t completed = 0;   // Exchanges that got a verdict
+    uint64_t accepted = 0;    // Assignments answered RESPONSE_OK, or with their bit set
+    uint64_t rejected = 0;    // Assignments answered wrong, or a handshake refused
+    uint64_t lost = 0;        // Gave up after all retries
+    uint64_t retransmits = 0;
+    uint64_t stray = 0;       // Late or unexpected datagrams
+    uint64_t unsolvable = 0;
+    LatencyHistogram handshakeRtt; // Microseconds
+    LatencyHistogram answerRtt;
+};
+
+struct LoadConfig {
+    int threads = DEFAULT_THREADS;
+    int concurrency = DEFAULT_CONCURRENCY;
+    double rate = 0; // Exchanges per second over all threads, 0 = as fast as the clients complete
+    int durationSec = DEFAULT_DURATION_SEC;
+    int timeoutMs = DEFAULT_TIMEOUT_MS;
+    int retries = DEFAULT_RETRIES;
+    int items = 1; // Assignments per exchange, above 1 with version 1.1 datagrams
+    sockaddr_storage server;
+    socklen_t serverLen;
+};
+
+class LoadThread {
+public:
+    LoadThread(const LoadConfig &config, int clientCount)
+        : config(config), clients(clientCount), wheel(1, 4096, monotonicMs()) {}
+
+    void run() {
+        epollFD = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFD == -1) {
+            perror("epoll_create1");
+            return;
+        }
+
+        for (size_t i = 0; i < clients.size(); i++) {
+            clients[i].state = VC_IDLE;
+            clients[i].fd = -1;
+            if (!openSocket(i)) return;
+            idle.push_back(i);
+        }
+
+        uint64_t startMs = monotonicMs();
+        uint64_t endMs = startMs + config.durationSec * 1000ULL;
+        double perThreadRate = config.rate / config.threads;
+        epoll_event events[EPOLL_BATCH];
+
+        while (true) {
+            uint64_t now = monotonicMs();
+            if (now >= endMs) break;
+
+            // Pacing: start as many exchanges as the target rate allows by now
+            if (perThreadRate > 0) {
+                uint64_t due = (uint64_t)((now - startMs) * perThreadRate / 1000.0);
+                while (stats.started < due && !idle.empty()) {
+                    startExchange(idle.back());
+                    idle.pop_back();
+                }
+            } else {
+                while (!idle.empty()) {
+                    startExchange(idle.back());
+                    idle.pop_back();
+                }
+            }
+
+            int timeout = wheel.nextTimeout(now);
+            if (perThreadRate > 0 && !idle.empty()) timeout = 1;
+            if (timeout < 0 || (uint64_t)timeout > endMs - now) timeout = endMs - now;
+
+            int ready = epoll_wait(epollFD, events, EPOLL_BATCH, timeout);
+            if (ready == -1 && errno != EINTR) {
+                perror("epoll_wait");
+                break;
+            }
+
+            for (int i = 0; i < ready; i++) {
+                drainClient(events[i].data.u32);
+            }
+
+            wheel.expire(monotonicMs(), [this](uint32_t index, uint64_t deadline) {
+                VirtualClient &vc = clients[index];
+                if (vc.state != VC_IDLE && vc.deadline == deadline) retransmit(index);
+            });
+        }
+
+        for (VirtualClient &vc : clients) {
+            if (vc.fd >= 0) close(vc.fd);
+        }
+        close(epollFD);
+    }
+
+    LoadStats stats;
+    uint64_t inFlightAtEnd() const {
+        uint64_t count = 0;
+        for (const VirtualClient &vc : clients) count += vc.state != VC_IDLE;
+        return count;
+    }
+
+private:
+    // A new non-blocking socket connected to the server, replacing the client's old one if it has one
+    bool openSocket(uint32_t index) {
+        VirtualClient &vc = clients[index];
+        if (vc.fd >= 0) close(vc.fd); // Also drops it from the epoll set
+        vc.fd = socket(config.server.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (vc.fd == -1 || connect(vc.fd, (sockaddr *)&config.server, config.serverLen) == -1) {
+            perror("socket/connect");
+            if (vc.fd >= 0) close(vc.fd);
+            vc.fd = -1;
+            return false;
+        }
+        epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u32 = index;
+        epoll_ctl(epollFD, EPOLL_CTL_ADD, vc.fd, &ev);
+        return true;
+    }
+
+    void arm(uint32_t index) {
+        VirtualClient &vc = clients[index];
+        vc.deadline = monotonicMs() + config.timeoutMs;
+        wheel.schedule(index, vc.deadline);
+    }
+
+    // Version 1.1 handshakes are padded to the size of the reply they ask for (protocol.h)
+    void sendHandshake(int fd) const {
+        if (config.items > 1) {
+            char packet[MULTI_HANDSHAKE_SIZE(MULTI_MAX_ITEMS)];
+            send(fd, packet, makeMultiHandshake(packet, config.items), 0);
+        } else {
+            calcMessage initMsg = makeHandshake();
+            send(fd, &initMsg, sizeof(initMsg), 0);
+        }
+    }
+
+    void startExchange(uint32_t index) {
+        VirtualClient &vc = clients[index];
+
+        vc.state = VC_HANDSHAKE;
+        vc.attempts = 1;
+        vc.resent = false;
+        vc.sentAt = monotonicUs();
+        stats.started++;
+        sendHandshake(vc.fd);
+        arm(index);
+    }
+
+    void finish(uint32_t index) {
+        VirtualClient &vc = clients[index];
+        vc.state = VC_IDLE;
+        if (vc.resent && !openSocket(index)) return; // Out of sockets: the client sits out the rest of the run
+        if (config.rate > 0) {
+            idle.push_back(index);
+        } else {
+            startExchange(index); // Closed loop: every client keeps one exchange in flight
+        }
+    }
+
+    void retransmit(uint32_t index) {
+        VirtualClient &vc = clients[index];
+        if (vc.attempts > config.retries) {
+            stats.lost++;
+            finish(index);
+            return;
+        }
+
+        vc.attempts++;
+        vc.resent = true;
+        stats.retransmits++;
+        if (vc.state == VC_HANDSHAKE) {
+            sendHandshake(vc.fd);
+        } else {
+            send(vc.fd, vc.answer, vc.answerLength, 0);
+        }
+        arm(index);
+    }
+
+    void drainClient(uint32_t index) {
+        VirtualClient &vc = clients[index];
+        char buffer[MAXBUFLEN];
+
+        while (vc.fd >= 0) {
+            ssize_t n = recv(vc.fd, buffer, sizeof(buffer), 0);
+            if (n == -1) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) perror("recv");
+                return;
+            }
+            handleReply(index, buffer, n);
+        }
+    }
+
+    void handleReply(uint32_t index, const char *buffer, ssize_t n) {
+        VirtualClient &vc = clients[index];
+        uint64_t now = monotonicUs();
+        calcMessageHost verdict;
+
+        size_t records = config.items > 1 ? multiRecordCount(buffer, n, 1) : n == sizeof(calcProtocol);
+        if (vc.state == VC_HANDSHAKE && records != 0) {
+            stats.handshakeRtt.record(now - vc.sentAt);
+
+            vc.answerLength = 0;
+            vc.items = records;
+            for (size_t i = 0; i < records; i++) {
+                calcProtocolHost task;
+                int32_t resultI;
+                double resultD;
+                decodeCalcProtocol(buffer + i * sizeof(calcProtocol), sizeof(calcProtocol), task);
+                if (!solveAssignment(task, resultI, resultD)) {
+                    stats.unsolvable++;
+                    if (records == 1) {
+                        finish(index);
+                        return;
+                    }
+                    // The others are still worth answering; this one goes back with a 0 result and its bit comes back clear
+                    resultI = 0;
+                    resultD = 0;
+                }
+                vc.answerLength += encodeAnswer(vc.answer + vc.answerLength, task, resultI, resultD);
+            }
+
+            vc.state = VC_ANSWER;
+            vc.attempts = 1;
+            vc.sentAt = monotonicUs();
+            send(vc.fd, vc.answer, vc.answerLength, 0);
+            arm(index);
+        } else if (vc.state != VC_IDLE && decodeCalcMessage(buffer, n, verdict) && verdict.type == 2) {
+            if (vc.state == VC_ANSWER) {
+                stats.answerRtt.record(now - vc.sentAt);
+            }
+            if (vc.state == VC_ANSWER && config.items > 1) {
+                // A version 1.1 verdict is a bitmap; a 1.0 one (NOT OK to a malformed batch) rejects all of it
+                size_t right = 0;
+                if (verdict.minor_version == MULTI_VERSION_MINOR) right = __builtin_popcount(verdict.message & ((1ULL << vc.items) - 1));
+                stats.accepted += right;
+                stats.rejected += vc.items - right;
+            } else if (vc.state == VC_ANSWER && verdict.message == 1) {
+                stats.accepted++;
+            } else {
+                stats.rejected++;
+            }
+            stats.completed++;
+            finish(index);
+        } else {
+            stats.stray++; // Reply to an earlier transmission of a finished round trip
+        }
+    }
+
+    const LoadConfig &config;
+    vector<VirtualClient> clients;
+    vector<uint32_t> idle;
+    TimerWheel<uint32_t> wheel;
+    int epollFD = -1;
+};
+
+void printLatency(const char *name, const LatencyHistogram &hist) {
+    printf("%-10s n=%-9llu mean=%8.1fus p50=%6lluus p99=%6lluus p999=%6lluus max=%6lluus\n", name,
+           (unsigned long long)hist.count(), hist.mean(),
+           (unsigned long long)hist.percentile(0.50), (unsigned long long)hist.percentile(0.99),
+           (unsigned long long)hist.percentile(0.999), (unsigned long long)hist.max());
+}
+
+void usage(const char *progName) {
+    fprintf(stderr, "Usage: %s [-t threads] [-c clients] [-r rate] [-d seconds] [-T timeout_ms] [-R retries] [-k items] <hostname:port>\n", progName);
+    fprintf(stderr, "  -t threads   sending threads (default %d)\n", DEFAULT_THREADS);
+    fprintf(stderr, "  -c clients   concurrent virtual clients over all threads (default %d)\n", DEFAULT_CONCURRENCY);
+    fprintf(stderr, "  -r rate      exchanges started per second, 0 = closed loop (default 0)\n");
+    fprintf(stderr, "  -d seconds   test duration (default %d)\n", DEFAULT_DURATION_SEC);
+    fprintf(stderr, "  -T ms        retransmission timeout (default %d)\n", DEFAULT_TIMEOUT_MS);
+    fprintf(stderr, "  -R retries   retransmissions before a round trip counts as lost (default %d)\n", DEFAULT_RETRIES);
+    fprintf(stderr, "  -k items     assignments per exchange, above 1 in version 1.1 datagrams (1-%d, default 1)\n", MULTI_MAX_ITEMS);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    LoadConfig config;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:c:r:d:T:R:k:")) != -1) {
+        switch (opt) {
+        case 't': config.threads = atoi(optarg); break;
+        case 'c': config.concurrency = atoi(optarg); break;
+        case 'r': config.rate = atof(optarg); break;
+        case 'd': config.durationSec = atoi(optarg); break;
+        case 'T': config.timeoutMs = atoi(optarg); break;
+        case 'R': config.retries = atoi(optarg); break;
+        case 'k': config.items = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1 || config.threads < 1 || config.concurrency < config.threads ||
+        config.durationSec < 1 || config.timeoutMs < 1 || config.retries < 0 ||
+        config.items < 1 || config.items > MULTI_MAX_ITEMS) {
+        usage(argv[0]);
+    }
+
+    char *hostStr = strtok(argv[optind], ":");
+    char *portToken = strtok(NULL, ":");
+    if (!hostStr || !portToken) usage(argv[0]);
+
+    addrinfo hints{}, *res = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(hostStr, portToken, &hints, &res) != 0) {
+        fprintf(stderr, "Error: cannot resolve %s:%s\n", hostStr, portToken);
+        return 1;
+    }
+    memcpy(&config.server, res->ai_addr, res->ai_addrlen);
+    config.serverLen = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    // One socket per virtual client, lift the descriptor limit as far as we may
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    printf("Load: %d clients on %d threads, rate %s, %d assignment(s) per exchange, %d s against %s:%s\n", config.concurrency,
+           config.threads, config.rate > 0 ? to_string((long)config.rate).c_str() : "unlimited", config.items, config.durationSec,
+           hostStr, portToken);
+
+    vector<LoadThread *> loaders;
+    vector<thread> threads;
+    for (int i = 0; i < config.threads; i++) {
+        int share = config.concurrency / config.threads + (i < config.concurrency % config.threads ? 1 : 0);
+        loaders.push_back(new LoadThread(config, share));
+    }
+
+    uint64_t startUs = monotonicUs();
+    for (LoadThread *loader : loaders) {
+        threads.emplace_back([loader]() { loader->run(); });
+    }
+    for (thread &t : threads) t.join();
+    double elapsed = (monotonicUs() - startUs) / 1e6;
+
+    LoadStats total;
+    uint64_t inFlight = 0;
+    for (LoadThread *loader : loaders) {
+        LoadStats &s = loader->stats;
+        total.started += s.started;
+        total.completed += s.completed;
+        total.accepted += s.accepted;
+        total.rejected += s.rejected;
+        total.lost += s.lost;
+        total.retransmits += s.retransmits;
+        total.stray += s.stray;
+        total.unsolvable += s.unsolvable;
+        total.handshakeRtt.merge(s.handshakeRtt);
+        total.answerRtt.merge(s.answerRtt);
+        inFlight += loader->inFlightAtEnd();
+        delete loader;
+    }
+
+    uint64_t verdicts = total.accepted + total.rejected;
+    printf("Elapsed     %.2f s\n", elapsed);
+    printf("Exchanges   started=%llu completed=%llu (%.0f/s) in-flight-at-end=%llu\n",
+           (unsigned long long)total.started, (unsigned long long)total.completed, total.completed / elapsed, (unsigned long long)inFlight);
+    printf("Verdicts    ok=%llu not-ok=%llu (%.0f/s) unsolvable=%llu\n", (unsigned long long)total.accepted,
+           (unsigned long long)total.rejected, verdicts / elapsed, (unsigned long long)total.unsolvable);
+    printf("Loss        lost=%llu (%.3f%%) retransmits=%llu stray=%llu\n", (unsigned long long)total.lost,
+           total.started ? 100.0 * total.lost / total.started : 0.0, (unsigned long long)total.retransmits, (unsigned long long)total.stray);
+    printLatency("handshake", total.handshakeRtt);
+    printLatency("answer", total.answerRtt);
+    return 0;
+}
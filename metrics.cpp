@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <thread>
+#include <string>
+#include <vector>
+#include "metrics.h"
+#include "serverlog.h"
+
+using namespace std;
+
+#define METRICS_MAX_SHARDS 64
+#define METRICS_POLL_MS 200 // How often the endpoint thread checks for metricsStop()
+#define METRICS_FIRST_EDGE 4  // Histogram "le" edges are 2^4 .. 2^24 microseconds
+#define METRICS_LAST_EDGE 24
+
+struct CounterInfo {
+    const char *name;
+    const char *help;
+};
+
+// Same order as enum MetricCounter
+static const CounterInfo counterInfo[M_COUNTER_COUNT] = {
+    {"calc_datagrams_received_total", "Datagrams received, including answers forwarded from other workers"},
+    {"calc_datagrams_bad_size_total", "Datagrams that were neither a handshake nor an answer"},
+    {"calc_handshakes_total", "Well-formed handshakes"},
+    {"calc_handshakes_invalid_total", "Handshakes with the wrong type, protocol or version"},
+    {"calc_handshakes_rate_limited_total", "Handshakes refused by the per-source rate limit"},
+    {"calc_sessions_refused_total", "Handshakes refused because the session limit was reached"},
+    {"calc_assignments_sent_total", "Assignments handed out"},
+    {"calc_assignment_pool_empty_total", "Handshakes that had to generate assignments because the pool was empty"},
+    {"calc_answers_valid_total", "Correct answers"},
+    {"calc_answers_wrong_total", "Answers with a wrong result"},
+    {"calc_answers_invalid_id_total", "Answers for an unknown or expired assignment ID"},
+    {"calc_answers_duplicate_total", "Retransmitted answers that got the verdict of their finished session again"},
+    {"calc_answers_spoofed_total", "Answers from an address other than the one the assignment went to"},
+    {"calc_sessions_timed_out_total", "Assignments that were never answered"},
+    {"calc_answers_forwarded_total", "Answers handed to the worker that issued their ID"},
+    {"calc_send_errors_total", "Failed sendto/sendmmsg datagrams"},
+    {"calc_recv_errors_total", "Failed recvfrom/recvmmsg calls"},
+    {"calc_tcp_connections_total", "TCP connections accepted"},
+};
+
+struct Gauge {
+    const char *name;
+    const char *help;
+    function<double()> sample;
+};
+
+static ShardMetrics *registered[METRICS_MAX_SHARDS];
+static int registeredCount = 0;
+static vector<Gauge> gauges;
+static int listenFD = -1;
+static atomic<bool> running{false};
+static thread server;
+
+void metricsRegister(int index, ShardMetrics *metrics) {
+    if (index < 0 || index >= METRICS_MAX_SHARDS) return;
+    registered[index] = metrics;
+    if (index >= registeredCount) registeredCount = index + 1;
+}
+
+void metricsGauge(const char *name, const char *help, function<double()> sample) {
+    gauges.push_back({name, help, sample});
+}
+
+static void appendf(string &out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void appendf(string &out, const char *format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length > 0) out.append(line, length < (int)sizeof(line) ? length : sizeof(line) - 1);
+}
+
+// Merge the workers' histograms and print them as cumulative power-of-two buckets in seconds
+static void appendHistogram(string &out, const char *name, const char *help, LatencyHistogram ShardMetrics::*member) {
+    LatencyHistogram *merged = new LatencyHistogram(); // ~9 KB, keep it off the thread's stack
+    for (int i = 0; i < registeredCount; i++) {
+        if (registered[i]) merged->merge(registered[i]->*member);
+    }
+
+    appendf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+
+    uint64_t cumulative = 0;
+    int bucket = 0;
+    for (int edge = METRICS_FIRST_EDGE; edge <= METRICS_LAST_EDGE; edge++) {
+        // Every bucket below 2^edge holds only values <= 2^edge - 1
+        while (bucket < HIST_BUCKETS && LatencyHistogram::bucketUpperEdge(bucket) < (1ULL << edge)) {
+            cumulative += merged->bucketCount(bucket++);
+        }
+        appendf(out, "%s_bucket{le=\"%g\"} %llu\n", name, (double)(1ULL << edge) / 1e6, (unsigned long long)cumulative);
+    }
+    appendf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)merged->count());
+    appendf(out, "%s_sum %g\n", name, (double)merged->totalSum() / 1e6);
+    appendf(out, "%s_count %llu\n", name, (unsigned long long)merged->count());
+
+    delete merged;
+}
+
+static string formatMetrics() {
+    string out;
+
+    for (int c = 0; c < M_COUNTER_COUNT; c++) {
+        appendf(out, "# HELP %s %s\n# TYPE %s counter\n", counterInfo[c].name, counterInfo[c].help, counterInfo[c].name);
+        for (int i = 0; i < registeredCount; i++) {
+            if (!registered[i]) continue;
+            appendf(out, "%s{worker=\"%d\"} %llu\n", counterInfo[c].name, i,
+                    (unsigned long long)registered[i]->counters[c].load(memory_order_relaxed));
+        }
+    }
+
+    appendHistogram(out, "calc_answer_seconds", "Time from sending an assignment to receiving its answer", &ShardMetrics::answerUs);
+    appendHistogram(out, "calc_batch_seconds", "Time to process one receive batch, recv to last reply sent", &ShardMetrics::batchUs);
+
+    appendf(out, "# HELP calc_log_lines_dropped_total Log lines dropped because the log ring was full\n");
+    appendf(out, "# TYPE calc_log_lines_dropped_total counter\n");
+    appendf(out, "calc_log_lines_dropped_total %llu\n", (unsigned long long)logDropped());
+
+    for (const Gauge &gauge : gauges) {
+        appendf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %g\n", gauge.name, gauge.help, gauge.name, gauge.name, gauge.sample());
+    }
+    return out;
+}
+
+// One scrape per connection: read the request line, answer, close
+static void serveScrape(int clientFD) {
+    char request[1024];
+    struct pollfd pfd = {clientFD, POLLIN, 0};
+    if (poll(&pfd, 1, METRICS_POLL_MS) <= 0 || recv(clientFD, request, sizeof(request), 0) <= 0) return;
+
+    string body = formatMetrics();
+    string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: ";
+    response += to_string(body.size());
+    response += "\r\nConnection: close\r\n\r\n";
+    response += body;
+
+    size_t sent = 0;
+    while (sent < response.size()) {
+        ssize_t n = send(clientFD, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) return;
+        sent += n;
+    }
+}
+
+static void serverLoop() {
+    while (running.load(memory_order_acquire)) {
+        struct pollfd pfd = {listenFD, POLLIN, 0};
+        if (poll(&pfd, 1, METRICS_POLL_MS) <= 0) continue;
+
+        int clientFD = accept(listenFD, NULL, NULL);
+        if (clientFD == -1) continue;
+        serveScrape(clientFD);
+        close(clientFD);
+    }
+}
+
+bool metricsStart(int port) {
+    listenFD = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFD == -1) {
+        perror("metrics socket");
+        return false;
+    }
+
+    int one = 1;
+    setsockopt(listenFD, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // Local scrapes only
+
+    if (bind(listenFD, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listenFD, 16) == -1) {
+        perror("metrics bind");
+        close(listenFD);
+        listenFD = -1;
+        return false;
+    }
+
+    running.store(true, memory_order_release);
+    server = thread(serverLoop);
+    return true;
+}
+
+void metricsStop() {
+    if (!running.exchange(false)) return;
+    server.join();
+    close(listenFD);
+    listenFD = -1;
+}
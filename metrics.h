@@ -0,0 +1,66 @@
+#ifndef __SERVER_METRICS
+#define __SERVER_METRICS
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include "histogram.h"
+
+/*
+   Server counters and latency histograms, exposed in Prometheus text format.
+
+   Every worker owns one ShardMetrics and is its only writer: counters are relaxed
+   atomics bumped with load+store (a plain increment, no locked instruction) and each
+   block is cache-line aligned so workers never share a line. metricsStart() runs a
+   thread that answers HTTP GETs on a loopback TCP port by reading all registered
+   blocks; readers never block the packet path and may see a scrape that is a few
+   increments behind.
+*/
+
+enum MetricCounter {
+    M_DATAGRAMS,       // Everything received, including forwarded answers
+    M_BAD_SIZE,        // Neither a calcMessage, a calcProtocol nor a text answer line
+    M_HANDSHAKES,      // Well-formed handshakes
+    M_BAD_HANDSHAKES,
+    M_RATE_LIMITED,
+    M_SESSIONS_REFUSED,
+    M_TASKS_SENT,
+    M_POOL_EMPTY,      // Handshakes that found the assignment pool empty
+    M_VALID,
+    M_WRONG_RESULT,
+    M_INVALID_ID,
+    M_DUPLICATES,      // Retransmitted answers given their cached verdict
+    M_SPOOFED,
+    M_TIMEOUTS,
+    M_FORWARDED,       // Answers handed to the shard that issued their ID
+    M_SEND_ERRORS,
+    M_RECV_ERRORS,
+    M_CONNECTIONS,     // TCP connections accepted (-T)
+    M_COUNTER_COUNT
+};
+
+struct alignas(64) ShardMetrics {
+    std::atomic<uint64_t> counters[M_COUNTER_COUNT];
+    LatencyHistogram answerUs; // Assignment sent to answer received, microseconds
+    LatencyHistogram batchUs;  // One receive batch from recv to last reply flushed, microseconds
+
+    ShardMetrics() {
+        for (int i = 0; i < M_COUNTER_COUNT; i++) counters[i].store(0, std::memory_order_relaxed);
+    }
+
+    void count(MetricCounter counter, uint64_t amount = 1) {
+        counters[counter].store(counters[counter].load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+};
+
+// Register a worker's block before metricsStart(); it is reported with worker="index"
+void metricsRegister(int index, ShardMetrics *metrics);
+
+// Extra gauge sampled on every scrape
+void metricsGauge(const char *name, const char *help, std::function<double()> sample);
+
+// Serve GET requests on 127.0.0.1:port; returns false if the port cannot be bound
+bool metricsStart(int port);
+void metricsStop();
+
+#endif
@@ -9,7 +9,12 @@
 #endif
 
 
+#ifndef __CALC_PROTOCOL
+#define __CALC_PROTOCOL
+
 #include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
 
 /* 
    Used in both directions; if 
@@ -43,6 +48,228 @@ struct  __attribute__((__packed__)) calcMessage {
 };
 
 
+/*
+   Double conversion helpers, shared by client and server so both put the
+   flValue1/flValue2/flResult fields on the wire in the same (big endian) order.
+ */
+static inline void convertDoubleToNet(double hostVal, double* netVal) {
+    uint64_t temp;
+    memcpy(&temp, &hostVal, sizeof(double));
+    temp = (((uint64_t)htonl(temp & 0xFFFFFFFFULL)) << 32) | htonl(temp >> 32);
+    memcpy(netVal, &temp, sizeof(double));
+}
+
+static inline void convertDoubleFromNet(double netVal, double* hostVal) {
+    uint64_t temp;
+    memcpy(&temp, &netVal, sizeof(double));
+    temp = (((uint64_t)ntohl(temp & 0xFFFFFFFFULL)) << 32) | ntohl(temp >> 32);
+    memcpy(hostVal, &temp, sizeof(double));
+}
+
+
+#ifdef __cplusplus
+#include <stddef.h>
+
+/*
+   Wire codec for calcMessage and calcProtocol (C++ only, header-only).
+
+   Every integer field travels big endian at its own width: 16-bit fields with a
+   16-bit swap, 32-bit fields with a 32-bit swap, doubles as a 64-bit big endian
+   pattern like convertDoubleToNet(). Each field is described once by its offset
+   and type (WireField), and decode/encode read and write those offsets directly in
+   the receive or send buffer, so a datagram is never copied into a packed struct
+   first and nothing is allocated.
+*/
+
+static inline uint16_t wireSwap(uint16_t value) { return ntohs(value); }
+static inline uint32_t wireSwap(uint32_t value) { return ntohl(value); }
+static inline int32_t wireSwap(int32_t value) { return (int32_t)ntohl((uint32_t)value); }
+
+static inline double wireSwap(double value) {
+    double result;
+    convertDoubleFromNet(value, &result); // A byte swap, so it is its own inverse
+    return result;
+}
+
+template <typename T, size_t Offset>
+struct WireField {
+    typedef T type;
+    static constexpr size_t offset = Offset;
+
+    static T load(const void *packet) {
+        T raw;
+        memcpy(&raw, (const char *)packet + Offset, sizeof(T));
+        return wireSwap(raw);
+    }
+
+    static void store(void *packet, T value) {
+        T raw = wireSwap(value);
+        memcpy((char *)packet + Offset, &raw, sizeof(T));
+    }
+};
+
+struct CalcMessageWire {
+    typedef WireField<uint16_t, offsetof(calcMessage, type)> Type;
+    typedef WireField<uint32_t, offsetof(calcMessage, message)> Message;
+    typedef WireField<uint16_t, offsetof(calcMessage, protocol)> Protocol;
+    typedef WireField<uint16_t, offsetof(calcMessage, major_version)> MajorVersion;
+    typedef WireField<uint16_t, offsetof(calcMessage, minor_version)> MinorVersion;
+    static constexpr size_t size = sizeof(calcMessage);
+};
+
+struct CalcProtocolWire {
+    typedef WireField<uint16_t, offsetof(calcProtocol, type)> Type;
+    typedef WireField<uint16_t, offsetof(calcProtocol, major_version)> MajorVersion;
+    typedef WireField<uint16_t, offsetof(calcProtocol, minor_version)> MinorVersion;
+    typedef WireField<uint32_t, offsetof(calcProtocol, id)> Id;
+    typedef WireField<uint32_t, offsetof(calcProtocol, arith)> Arith;
+    typedef WireField<int32_t, offsetof(calcProtocol, inValue1)> InValue1;
+    typedef WireField<int32_t, offsetof(calcProtocol, inValue2)> InValue2;
+    typedef WireField<int32_t, offsetof(calcProtocol, inResult)> InResult;
+    typedef WireField<double, offsetof(calcProtocol, flValue1)> FlValue1;
+    typedef WireField<double, offsetof(calcProtocol, flValue2)> FlValue2;
+    typedef WireField<double, offsetof(calcProtocol, flResult)> FlResult;
+    static constexpr size_t size = sizeof(calcProtocol);
+};
+
+// Host byte order views of the two messages
+struct calcMessageHost {
+    uint16_t type;
+    uint32_t message;
+    uint16_t protocol;
+    uint16_t major_version;
+    uint16_t minor_version;
+};
+
+struct calcProtocolHost {
+    uint16_t type;
+    uint16_t major_version;
+    uint16_t minor_version;
+    uint32_t id;
+    uint32_t arith;
+    int32_t inValue1;
+    int32_t inValue2;
+    int32_t inResult;
+    double flValue1;
+    double flValue2;
+    double flResult;
+};
+
+// False if the datagram is not exactly one calcMessage
+static inline bool decodeCalcMessage(const void *packet, size_t length, calcMessageHost &out) {
+    if (length != CalcMessageWire::size) return false;
+    out.type = CalcMessageWire::Type::load(packet);
+    out.message = CalcMessageWire::Message::load(packet);
+    out.protocol = CalcMessageWire::Protocol::load(packet);
+    out.major_version = CalcMessageWire::MajorVersion::load(packet);
+    out.minor_version = CalcMessageWire::MinorVersion::load(packet);
+    return true;
+}
+
+// Writes sizeof(calcMessage) bytes and returns that size
+static inline size_t encodeCalcMessage(void *packet, const calcMessageHost &in) {
+    CalcMessageWire::Type::store(packet, in.type);
+    CalcMessageWire::Message::store(packet, in.message);
+    CalcMessageWire::Protocol::store(packet, in.protocol);
+    CalcMessageWire::MajorVersion::store(packet, in.major_version);
+    CalcMessageWire::MinorVersion::store(packet, in.minor_version);
+    return CalcMessageWire::size;
+}
+
+// False if the datagram is not exactly one calcProtocol
+static inline bool decodeCalcProtocol(const void *packet, size_t length, calcProtocolHost &out) {
+    if (length != CalcProtocolWire::size) return false;
+    out.type = CalcProtocolWire::Type::load(packet);
+    out.major_version = CalcProtocolWire::MajorVersion::load(packet);
+    out.minor_version = CalcProtocolWire::MinorVersion::load(packet);
+    out.id = CalcProtocolWire::Id::load(packet);
+    out.arith = CalcProtocolWire::Arith::load(packet);
+    out.inValue1 = CalcProtocolWire::InValue1::load(packet);
+    out.inValue2 = CalcProtocolWire::InValue2::load(packet);
+    out.inResult = CalcProtocolWire::InResult::load(packet);
+    out.flValue1 = CalcProtocolWire::FlValue1::load(packet);
+    out.flValue2 = CalcProtocolWire::FlValue2::load(packet);
+    out.flResult = CalcProtocolWire::FlResult::load(packet);
+    return true;
+}
+
+// Writes sizeof(calcProtocol) bytes and returns that size
+static inline size_t encodeCalcProtocol(void *packet, const calcProtocolHost &in) {
+    CalcProtocolWire::Type::store(packet, in.type);
+    CalcProtocolWire::MajorVersion::store(packet, in.major_version);
+    CalcProtocolWire::MinorVersion::store(packet, in.minor_version);
+    CalcProtocolWire::Id::store(packet, in.id);
+    CalcProtocolWire::Arith::store(packet, in.arith);
+    CalcProtocolWire::InValue1::store(packet, in.inValue1);
+    CalcProtocolWire::InValue2::store(packet, in.inValue2);
+    CalcProtocolWire::InResult::store(packet, in.inResult);
+    CalcProtocolWire::FlValue1::store(packet, in.flValue1);
+    CalcProtocolWire::FlValue2::store(packet, in.flValue2);
+    CalcProtocolWire::FlResult::store(packet, in.flResult);
+    return CalcProtocolWire::size;
+}
+
+/*
+   Multi-assignment datagrams, version 1.1 over UDP. A handshake with minor_version 1
+   asks for `message` assignments at once. They come back packed in one datagram: up to
+   that many calcProtocol records back to back, each with minor_version 1 and its own
+   id; the receiver counts them from the length. The answers go back the same way, all
+   records in one datagram, and the verdict is a calcMessage with minor_version 1 whose
+   message is a bitmap: bit i is set if record i of the answer was right. Version 1.0
+   exchanges are untouched.
+
+   The handshake is padded with zeros to the size of the datagram it asks for,
+   MULTI_HANDSHAKE_SIZE(items). The server sends no more records than fit in the bytes
+   it received (but always one, like version 1.0), so a handshake with a forged source
+   address gets no more amplification than a version 1.0 one.
+*/
+#define MULTI_VERSION_MINOR 1
+#define MULTI_MAX_ITEMS 28 // 1400 bytes of records, one datagram within a 1500-byte MTU; the bitmap has 32 bits
+#define MULTI_HANDSHAKE_SIZE(items) ((size_t)(items) * CalcProtocolWire::size)
+
+// A padded version 1.1 handshake; its calcMessage header is decoded into out
+static inline bool decodeMultiHandshake(const void *packet, size_t length, calcMessageHost &out) {
+    if (length <= CalcMessageWire::size || length > MULTI_HANDSHAKE_SIZE(MULTI_MAX_ITEMS)) return false;
+    return decodeCalcMessage(packet, CalcMessageWire::size, out) && out.type == 22 && out.minor_version == MULTI_VERSION_MINOR;
+}
+
+// Most records a version 1.1 handshake of this length may be answered with
+static inline size_t multiRecordBudget(size_t handshakeLength) {
+    return handshakeLength < CalcProtocolWire::size ? 1 : handshakeLength / CalcProtocolWire::size;
+}
+
+// Records in a version 1.1 datagram of calcProtocols of this type (1 assignments, 2 answers), 0 if it is not one
+static inline size_t multiRecordCount(const void *data, size_t length, uint16_t type) {
+    if (length == 0 || length % CalcProtocolWire::size != 0 || length / CalcProtocolWire::size > MULTI_MAX_ITEMS) return 0;
+    if (CalcProtocolWire::Type::load(data) != type || CalcProtocolWire::MinorVersion::load(data) != MULTI_VERSION_MINOR) return 0;
+    return length / CalcProtocolWire::size;
+}
+
+/*
+   Stream framing for protocol 6 (TCP). Messages follow each other on the stream with
+   nothing in between; the type field at the start of each one says which struct it is
+   and so how long it is. Type 2 is an answer (calcProtocol) on its way to the server
+   but a verdict (calcMessage) coming back, so the lookup depends on the direction.
+*/
+#define STREAM_FRAME_INVALID ((size_t)-1)
+
+// Size of the message at the start of data: 0 until its type has arrived, STREAM_FRAME_INVALID for an unknown type
+static inline size_t streamFrameSize(const void *data, size_t available, bool toServer) {
+    if (available < sizeof(uint16_t)) return 0;
+    uint16_t type = CalcMessageWire::Type::load(data); // Same offset in both structs
+    if (toServer) {
+        if (type == 22) return CalcMessageWire::size;
+        if (type == 2) return CalcProtocolWire::size;
+    } else {
+        if (type == 1) return CalcProtocolWire::size;
+        if (type == 2) return CalcMessageWire::size;
+    }
+    return STREAM_FRAME_INVALID;
+}
+
+#endif
+
+
 /* arith mapping in calcProtocol
 1 - add
 2 - sub
@@ -74,3 +301,5 @@ other numbers are reserved
    2 = NOT OK  // Reject 
 
 */
+
+#endif
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <algorithm>
+#include "reactor.h"
+
+using namespace std;
+
+#define REACTOR_EVENTS 64 // epoll_wait batch
+
+Reactor::Reactor() : epollFD(-1), stopped(false) {}
+
+Reactor::~Reactor() {
+    for (Source &source : sources) {
+        if (source.owned && !source.removed) close(source.fd);
+    }
+    if (epollFD != -1) close(epollFD);
+}
+
+bool Reactor::init() {
+    epollFD = epoll_create1(EPOLL_CLOEXEC);
+    return epollFD != -1;
+}
+
+bool Reactor::add(int fd, uint32_t events, bool owned, Handler handler) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events | EPOLLET;
+    event.data.u32 = freeSources.empty() ? sources.size() : freeSources.back();
+    if (epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &event) == -1) return false;
+
+    if (event.data.u32 == sources.size()) {
+        sources.push_back({fd, owned, false, handler});
+    } else {
+        freeSources.pop_back();
+        sources[event.data.u32] = {fd, owned, false, handler};
+    }
+    byFd[fd] = event.data.u32;
+    return true;
+}
+
+bool Reactor::watch(int fd, uint32_t events, Handler handler) {
+    return add(fd, events, false, handler);
+}
+
+void Reactor::unwatch(int fd) {
+    auto it = byFd.find(fd);
+    if (it == byFd.end()) return;
+    epoll_ctl(epollFD, EPOLL_CTL_DEL, fd, NULL);
+    sources[it->second].removed = true;
+    retired.push_back(it->second);
+    byFd.erase(it);
+}
+
+int Reactor::addTimer(uint64_t intervalMs, function<void()> handler) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1) return -1;
+
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = intervalMs / 1000;
+    spec.it_interval.tv_nsec = (intervalMs % 1000) * 1000000;
+    spec.it_value = spec.it_interval;
+    if (timerfd_settime(fd, 0, &spec, NULL) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    bool added = add(fd, EPOLLIN, true, [fd, handler](uint32_t) {
+        uint64_t expirations;
+        if (read(fd, &expirations, sizeof(expirations)) > 0) handler(); // Late firings collapse into one call
+        return false;
+    });
+    if (!added) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int Reactor::addSignals(const sigset_t &signals, function<void(int)> handler) {
+    int fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd == -1) return -1;
+
+    bool added = add(fd, EPOLLIN, true, [fd, handler](uint32_t) {
+        struct signalfd_siginfo info;
+        while (read(fd, &info, sizeof(info)) == (ssize_t)sizeof(info)) handler(info.ssi_signo);
+        return false;
+    });
+    if (!added) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void Reactor::run() {
+    struct epoll_event events[REACTOR_EVENTS];
+    vector<uint32_t> again;
+
+    stopped = false;
+    while (!stopped) {
+        if (pending.empty() && idle) idle();
+
+        int ready = epoll_wait(epollFD, events, REACTOR_EVENTS, pending.empty() ? -1 : 0);
+        if (ready == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+                return;
+            }
+            ready = 0;
+        }
+
+        // Sources left over from the last round go first, then the new edges
+        again.clear();
+        for (uint32_t index : pending) {
+            if (!sources[index].removed && sources[index].handler(EPOLLIN)) again.push_back(index);
+        }
+        for (int i = 0; i < ready && !stopped; i++) {
+            uint32_t index = events[i].data.u32;
+            if (sources[index].removed) continue;
+            bool queued = false;
+            for (uint32_t waiting : again) queued |= waiting == index;
+            if (sources[index].handler(events[i].events) && !queued) again.push_back(index);
+        }
+        pending.swap(again);
+
+        // No handler is running now, so the unwatched ones can go
+        if (!retired.empty()) {
+            pending.erase(remove_if(pending.begin(), pending.end(), [this](uint32_t index) { return sources[index].removed; }),
+                          pending.end());
+        }
+        for (uint32_t index : retired) {
+            sources[index].handler = nullptr;
+            freeSources.push_back(index);
+        }
+        retired.clear();
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef __SERVER_REACTOR
+#define __SERVER_REACTOR
+
+#include <stdint.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <deque>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+/*
+   Edge-triggered epoll event loop, one per thread.
+
+   Sources are descriptors with a handler: sockets and eventfds registered with watch(),
+   periodic timerfds from addTimer() and a signalfd from addSignals(). Everything is
+   registered with EPOLLET, so a handler is called once per edge and must drain its
+   descriptor. To keep one busy socket from starving the others, a handler may stop
+   early after a budget and return true ("more to do"); the reactor then calls it again
+   after the other ready sources have had their turn, polling epoll without blocking
+   until no handler reports more work. Timer and signal handlers get the descriptor
+   already read.
+
+   unwatch() takes a descriptor off the loop before the caller closes it, and may be
+   called from the descriptor's own handler. The slot is only recycled after the
+   current round, so events already fetched for it are dropped rather than delivered
+   to a newer descriptor. watch() may be called from a handler too, such as a listener
+   registering the connections it accepts.
+
+   The idle hook runs each time the loop is about to block. stop() ends run() after the
+   current round, and run() may be called again later; it must be called from the reactor's own thread, so other threads
+   signal an eventfd whose handler calls it.
+*/
+
+class Reactor {
+public:
+    typedef std::function<bool(uint32_t events)> Handler; // Returns true if it stopped before draining
+
+    Reactor();
+    ~Reactor();
+
+    bool init(); // false with errno set if epoll_create1 fails
+
+    bool watch(int fd, uint32_t events, Handler handler);
+    void unwatch(int fd);
+
+    // Periodic timer, first firing after intervalMs; returns the timerfd or -1
+    int addTimer(uint64_t intervalMs, std::function<void()> handler);
+
+    // Deliver these signals through a signalfd; the caller must already have blocked them
+    // in every thread (pthread_sigmask before starting any). Returns the signalfd or -1.
+    int addSignals(const sigset_t &signals, std::function<void(int signal)> handler);
+
+    void setIdle(std::function<void()> hook) { idle = hook; }
+
+    void run();
+    void stop() { stopped = true; }
+
+private:
+    struct Source {
+        int fd;
+        bool owned; // Timer and signal descriptors are closed by the reactor
+        bool removed;
+        Handler handler;
+    };
+
+    bool add(int fd, uint32_t events, bool owned, Handler handler);
+
+    int epollFD;
+    bool stopped;
+    std::deque<Source> sources; // A deque, so watch() from a running handler never moves that handler
+    std::unordered_map<int, uint32_t> byFd; // Index into sources of each watched descriptor
+    std::vector<uint32_t> pending; // Sources whose handler reported more work
+    std::vector<uint32_t> retired; // Unwatched this round, free once it is over
+    std::vector<uint32_t> freeSources;
+    std::function<void()> idle;
+};
+
+#endif
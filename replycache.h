@@ -0,0 +1,81 @@
+#ifndef __REPLY_CACHE
+#define __REPLY_CACHE
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/*
+   Bounded cache of recently completed sessions and the verdict each one got, so a
+   retransmitted answer is answered the same way after its session is gone.
+
+   Entries live in a ring in completion order and are found through a direct-mapped
+   index of ring sequence numbers. The sequence number doubles as a generation: an
+   index slot whose sequence is more than capacity behind the ring head points at a
+   record that has since been overwritten and is treated as empty, so nothing is ever
+   deleted. A colliding insert simply replaces the index slot; the older record stays
+   in the ring but can no longer be found, which only shortens its life.
+
+   Each record keeps a caller-supplied fingerprint of the answer (the server hashes
+   the peer address with the datagram), so only an identical retransmission from the
+   same peer gets the cached verdict. Records older than ttlMs are ignored. A verdict is
+   whatever 32-bit value the caller replies with: a response code, or the bitmap of a
+   multi-assignment answer, where 0 is a valid verdict too.
+*/
+
+class ReplyCache {
+public:
+    ReplyCache(size_t capacity, uint64_t ttlMs) : head(0), ttl(ttlMs) {
+        slotCount = 16;
+        while (slotCount < capacity) slotCount <<= 1;
+        ring.resize(capacity ? slotCount : 0);
+        index.assign(capacity ? slotCount * 2 : 0, 0);
+    }
+
+    bool enabled() const { return !ring.empty(); }
+
+    void insert(uint32_t id, uint64_t fingerprint, uint32_t verdict, uint64_t nowMs) {
+        if (!enabled()) return;
+        Record &record = ring[head & (slotCount - 1)];
+        record.id = id;
+        record.verdict = verdict;
+        record.fingerprint = fingerprint;
+        record.completedMs = nowMs;
+        head++;
+        index[slotFor(id)] = head; // Sequence of the record + 1, 0 marks an empty slot
+    }
+
+    // Sets verdict to the one stored for this ID and fingerprint; false if there is none
+    bool find(uint32_t id, uint64_t fingerprint, uint64_t nowMs, uint32_t &verdict) const {
+        if (!enabled()) return false;
+        uint64_t sequence = index[slotFor(id)];
+        if (sequence == 0 || head - sequence >= slotCount) return false;
+
+        const Record &record = ring[(sequence - 1) & (slotCount - 1)];
+        if (record.id != id || record.fingerprint != fingerprint || nowMs - record.completedMs > ttl) return false;
+        verdict = record.verdict;
+        return true;
+    }
+
+    size_t capacity() const { return ring.size(); }
+
+private:
+    struct Record {
+        uint32_t id;
+        uint32_t verdict;
+        uint64_t fingerprint;
+        uint64_t completedMs;
+    };
+
+    size_t slotFor(uint32_t id) const {
+        return (size_t)((id * 0x9E3779B97F4A7C15ULL) >> 32) & (index.size() - 1);
+    }
+
+    std::vector<Record> ring;
+    std::vector<uint64_t> index;
+    size_t slotCount;
+    uint64_t head; // Records inserted so far
+    uint64_t ttl;
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef __RTO_ESTIMATOR
+#define __RTO_ESTIMATOR
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+   Retransmission timeout for the client, computed as in RFC 6298.
+
+   sample() feeds a round-trip time from an exchange that was sent exactly once
+   (Karn's rule: a reply to a retransmitted datagram cannot be attributed to either
+   copy) and updates SRTT/RTTVAR with the standard gains of 1/8 and 1/4. backoff()
+   doubles the timeout after every expiry and the next valid sample recomputes it.
+   The timeout is clamped to [minUs, RTO_MAX_US]; the RFC's 1 s floor is for TCP's
+   delayed ACKs, which the calc protocol does not have, so the floor is configurable.
+
+   timeoutUs() adds up to 1/8 of random jitter so that a burst of datagrams lost
+   together is not retransmitted together. minRttUs() is the smallest sample seen, used
+   to tell spurious retransmissions (a reply too quick to answer the retry) from real ones.
+*/
+
+#define RTO_INITIAL_US 1000000  // RFC 6298 2.1, before the first sample
+#define RTO_MAX_US 60000000
+#define RTO_GRANULARITY_US 1000 // Timers fire with poll(), so at millisecond resolution
+
+class RtoEstimator {
+public:
+    explicit RtoEstimator(uint64_t minUs)
+        : srtt(0), rttvar(0), rto(RTO_INITIAL_US), floorUs(minUs), minRtt(UINT64_MAX), samples(0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        state = ((uint64_t)ts.tv_nsec << 20) ^ (uint64_t)getpid() ^ 0x9E3779B97F4A7C15ULL;
+        clamp();
+    }
+
+    void sample(uint64_t rttUs) {
+        if (samples++ == 0) {
+            srtt = rttUs;
+            rttvar = rttUs / 2;
+        } else {
+            uint64_t delta = srtt > rttUs ? srtt - rttUs : rttUs - srtt;
+            rttvar = (3 * rttvar + delta) / 4;
+            srtt = (7 * srtt + rttUs) / 8;
+        }
+        if (rttUs < minRtt) minRtt = rttUs;
+        rto = srtt + (4 * rttvar > RTO_GRANULARITY_US ? 4 * rttvar : RTO_GRANULARITY_US);
+        clamp();
+    }
+
+    void backoff() {
+        rto *= 2;
+        clamp();
+    }
+
+    uint64_t timeoutUs() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return rto + state % (rto / 8 + 1);
+    }
+
+    uint64_t currentRtoUs() const { return rto; }
+    uint64_t srttUs() const { return srtt; }
+    uint64_t rttvarUs() const { return rttvar; }
+    uint64_t minRttUs() const { return samples ? minRtt : 0; }
+    uint64_t sampleCount() const { return samples; }
+
+private:
+    void clamp() {
+        if (rto < floorUs) rto = floorUs;
+        if (rto > RTO_MAX_US) rto = RTO_MAX_US;
+    }
+
+    uint64_t srtt, rttvar, rto;
+    uint64_t floorUs;
+    uint64_t minRtt;
+    uint64_t samples;
+    uint64_t state; // xorshift64 for the jitter
+};
+
+#endif
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <atomic>
+#include <thread>
+#include "serverlog.h"
+
+using namespace std;
+
+#define LOG_RING_SIZE 4096 // Power of two
+#define LOG_IDLE_SLEEP_US 2000
+
+#ifdef DEBUG
+int logLevel = LOG_DEBUG;
+#else
+int logLevel = LOG_INFO;
+#endif
+
+struct LogSlot {
+    atomic<uint64_t> sequence;
+    int length;
+    char text[LOG_LINE_MAX];
+};
+
+struct EventState {
+    uint64_t seen;
+    uint64_t windowStart; // Second the current rate window started
+    uint32_t windowCount;
+};
+
+static LogSlot ring[LOG_RING_SIZE];
+static atomic<uint64_t> enqueuePos{0};
+static uint64_t dequeuePos = 0; // Only touched by the writer thread
+static atomic<uint64_t> droppedLines{0};
+static atomic<bool> running{false};
+static thread writer;
+
+static LogEvent *events[LOG_MAX_EVENTS];
+static int eventCount = 0;
+static uint32_t sampleOverride = 0;
+static uint32_t rateOverride = 0;
+static thread_local EventState eventStates[LOG_MAX_EVENTS];
+
+LogEvent::LogEvent(const char *eventName, uint32_t sample, uint32_t rate)
+    : name(eventName), sampleEvery(sample ? sample : 1), perSecond(rate), index(eventCount) {
+    if (eventCount < LOG_MAX_EVENTS) {
+        events[eventCount++] = this;
+    } else {
+        index = LOG_MAX_EVENTS - 1; // Extra events share the last slot's counters
+    }
+}
+
+int logParseLevel(const char *name) {
+    static const char *names[] = {"error", "warn", "info", "debug"};
+    for (int i = 0; i < 4; i++) {
+        if (strcasecmp(name, names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+void logOverrideLimits(uint32_t sampleEvery, uint32_t perSecond) {
+    sampleOverride = sampleEvery;
+    rateOverride = perSecond;
+}
+
+bool logAdmit(LogEvent &event) {
+    EventState &state = eventStates[event.index];
+    uint32_t sampleEvery = sampleOverride ? sampleOverride : event.sampleEvery;
+    uint32_t perSecond = rateOverride ? rateOverride : event.perSecond;
+
+    if (sampleEvery > 1 && state.seen++ % sampleEvery != 0) return false;
+
+    if (perSecond) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        if ((uint64_t)ts.tv_sec != state.windowStart) {
+            state.windowStart = ts.tv_sec;
+            state.windowCount = 0;
+        }
+        if (state.windowCount >= perSecond) return false;
+        state.windowCount++;
+    }
+    return true;
+}
+
+void logWrite(int level, const char *format, ...) {
+    uint64_t pos = enqueuePos.load(memory_order_relaxed);
+    LogSlot *slot;
+
+    while (true) {
+        slot = &ring[pos & (LOG_RING_SIZE - 1)];
+        uint64_t sequence = slot->sequence.load(memory_order_acquire);
+        int64_t diff = (int64_t)sequence - (int64_t)pos;
+
+        if (diff == 0) {
+            if (enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            droppedLines.fetch_add(1, memory_order_relaxed); // Ring full, never block a worker
+            return;
+        } else {
+            pos = enqueuePos.load(memory_order_relaxed);
+        }
+    }
+
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(slot->text, LOG_LINE_MAX - 1, format, args);
+    va_end(args);
+
+    if (length < 0) length = 0;
+    if (length > LOG_LINE_MAX - 2) length = LOG_LINE_MAX - 2;
+    if (length == 0 || slot->text[length - 1] != '\n') slot->text[length++] = '\n';
+    slot->length = length;
+
+    slot->sequence.store(pos + 1, memory_order_release);
+}
+
+uint64_t logDropped() {
+    return droppedLines.load(memory_order_relaxed);
+}
+
+// Write out every line that is ready; returns how many were written
+static size_t drainRing() {
+    size_t written = 0;
+
+    while (true) {
+        LogSlot &slot = ring[dequeuePos & (LOG_RING_SIZE - 1)];
+        if (slot.sequence.load(memory_order_acquire) != dequeuePos + 1) break;
+
+        fwrite(slot.text, 1, slot.length, stdout);
+        slot.sequence.store(dequeuePos + LOG_RING_SIZE, memory_order_release);
+        dequeuePos++;
+        written++;
+    }
+
+    if (written) fflush(stdout);
+    return written;
+}
+
+static void writerLoop() {
+    uint64_t reportedDrops = 0;
+
+    while (running.load(memory_order_acquire)) {
+        if (drainRing() == 0) usleep(LOG_IDLE_SLEEP_US);
+
+        uint64_t drops = logDropped();
+        if (drops != reportedDrops) {
+            fprintf(stdout, "[log] %llu lines dropped, ring full\n", (unsigned long long)(drops - reportedDrops));
+            reportedDrops = drops;
+        }
+    }
+    drainRing();
+}
+
+void logStart() {
+    for (uint64_t i = 0; i < LOG_RING_SIZE; i++) {
+        ring[i].sequence.store(i, memory_order_relaxed);
+    }
+    running.store(true, memory_order_release);
+    writer = thread(writerLoop);
+}
+
+void logStop() {
+    if (!running.exchange(false)) return;
+    writer.join();
+}
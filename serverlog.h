@@ -0,0 +1,56 @@
+#ifndef __SERVER_LOG
+#define __SERVER_LOG
+
+#include <stdint.h>
+
+/*
+   Asynchronous logging for the server hot path.
+
+   LOG() checks the level and the event's sampling/rate limit before it evaluates
+   its arguments, so a suppressed line costs a compare and a counter bump. Admitted
+   lines are formatted into a slot of a lock-free ring buffer (bounded MPMC queue,
+   one sequence number per slot) and written to stdout by a background thread. When
+   the ring is full the line is dropped and counted instead of blocking the worker.
+
+   Each call site names a LogEvent. Its sampling (emit 1 of every N) and rate limit
+   (lines per second) are tracked per thread, so workers never share a counter.
+*/
+
+enum LogLevel {
+    LOG_ERROR = 0,
+    LOG_WARN = 1,
+    LOG_INFO = 2,
+    LOG_DEBUG = 3
+};
+
+#define LOG_MAX_EVENTS 64
+#define LOG_LINE_MAX 200
+
+struct LogEvent {
+    const char *name;
+    uint32_t sampleEvery; // 1 = every occurrence
+    uint32_t perSecond;   // 0 = no rate limit
+    int index;
+
+    LogEvent(const char *eventName, uint32_t sample = 1, uint32_t rate = 0);
+};
+
+extern int logLevel;
+
+int logParseLevel(const char *name); // -1 if unknown
+void logOverrideLimits(uint32_t sampleEvery, uint32_t perSecond); // 0 keeps each event's default
+bool logAdmit(LogEvent &event);
+void logWrite(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+uint64_t logDropped();
+
+void logStart();
+void logStop(); // Flushes everything still queued
+
+#define LOG(level, event, ...)                                  \
+    do {                                                        \
+        if ((level) <= logLevel && logAdmit(event)) {           \
+            logWrite((level), __VA_ARGS__);                     \
+        }                                                       \
+    } while (0)
+
+#endif
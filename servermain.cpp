@@ -7,217 +7,2104 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#include <algorithm>
 #include <cmath>
 #include <map>
 #include <string>
 #include <ctime>
 #include <sys/select.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <libgen.h>
+#include <sys/random.h>
+#include <pthread.h>
 #include <calcLib.h>
 #include "protocol.h"
+#include "textprotocol.h"
+#include "timerwheel.h"
+#include "slotarena.h"
+#include "serverlog.h"
+#include "siphash.h"
+#include "admission.h"
+#include "metrics.h"
+#include "uring.h"
+#include "assignmentpool.h"
+#include "replycache.h"
+#include "reactor.h"
+#include "handoff.h"
+#include "datagram.h"
 
 using namespace std;
 
-#define MAXBUFLEN 100
 #define PROTOCOL_TYPE 22
+#define PROTOCOL_TEXT_TYPE 21 // Handshake asking for the text variant (textprotocol.h)
 #define PROTOCOL_MESSAGE 0
 #define PROTOCOL_VERSION_MAJOR 1
 #define PROTOCOL_VERSION_MINOR 0
 #define TIMEOUT_SEC 10
+#define FLOAT_EPSILON 0.0001 // Allowed difference between a client's float result and ours
+#define TIMER_TICK_MS 100 // Expiry resolution of the timer wheel
+#define TIMER_SLOTS 256   // 25.6 s per rotation, longer than TIMEOUT_SEC
+#define DEFAULT_BATCH_SIZE 32 // Datagrams per recvmmsg/sendmmsg, 1 selects the per-packet path
+#define MAX_BATCH_SIZE 1024
+#define MAX_WORKERS 64
+#define DRAIN_BUDGET 16 // recv calls per readiness callback before other sources get a turn
+#define DEFAULT_SESSION_CAPACITY 65536 // Outstanding assignments per worker
+#define DEFAULT_POOL_SIZE 1024 // Ready-to-send assignments each worker keeps
+#define DEFAULT_REPLY_CACHE 8192 // Completed sessions each worker remembers for retransmitted answers
+#define URING_BUFFERS 1024 // Provided receive buffers per worker with -U, a power of two
+#define URING_BUFFER_SIZE 2048 // io_uring_recvmsg_out + sockaddr_storage + MAXBUFLEN, rounded up
+#define URING_CQ_ENTRIES 4096
+#define URING_STOP_POLL_MS 100 // Wait between checks while a stopping worker lets its receives and sends finish
+#define ADMISSION_SOURCES 16384 // Source prefixes each worker tracks for -a rate limiting
+#define STREAM_INPUT_SIZE 4096 // Read buffer of a TCP connection
+#define STREAM_OUTPUT_LIMIT 65536 // Unsent reply bytes at which a TCP connection stops being read
+#define STREAM_BACKLOG 1024
+#define COOKIE_STAMP_SHIFT 24 // Stateless IDs: 8 bits of seconds, 24 bits of MAC
+#define COOKIE_MAC_MASK 0xFFFFFFu
+#define SHARD_ID_SHIFT 26 // Top 6 bits of calcProtocol.id name the shard that issued it, the rest come from its SlotArena
 
+// Fixed-size record stored inline in the session arena, so a lookup touches no heap memory
 struct ClientData {
-    int id;
-    string ipAddress;
-    int portNumber;
-    time_t lastActivity;
+    uint32_t id; // Issued by the arena: shard | generation | slot, 0 = free slot
+    sockaddr_storage addr; // Peer the assignment was sent to, compared byte-wise on the answer
+    uint64_t lastActivityUs; // monotonicUs() when the assignment was handed out
     calcProtocol assignment;
+    calcExpected expected; // Answer computed when the task was generated
+};
+
+// Log call sites; per-packet events are rate limited per worker by default, -s/-r override all of them
+LogEvent EV_RECEIVED("received");
+LogEvent EV_TASK_SENT("task_sent");
+LogEvent EV_VALID("valid", 1, 100);
+LogEvent EV_WRONG_RESULT("wrong_result", 1, 100);
+LogEvent EV_TIMEOUT("timeout", 1, 100);
+LogEvent EV_BAD_HANDSHAKE("bad_handshake", 1, 10);
+LogEvent EV_TABLE_FULL("table_full", 1, 10);
+LogEvent EV_RATE_LIMITED("rate_limited", 1, 10);
+LogEvent EV_INVALID_ID("invalid_id", 1, 10);
+LogEvent EV_SPOOF("spoof", 1, 10);
+LogEvent EV_DUPLICATE("duplicate", 1, 100);
+LogEvent EV_CONNECTION("connection", 1, 100);
+LogEvent EV_STATS("stats");
+LogEvent EV_LIFECYCLE("lifecycle");
+LogEvent EV_IO_ERROR("io_error", 1, 10);
+
+// Printable "address:port" of a peer, built only when a log line needs it
+struct EndpointText {
+    char text[INET6_ADDRSTRLEN + 8];
+};
+
+EndpointText endpointText(const sockaddr_storage &addr) {
+    EndpointText out;
+    char ip[INET6_ADDRSTRLEN] = "?";
+    int port = 0;
+
+    if (addr.ss_family == AF_INET) {
+        const sockaddr_in *in = (const sockaddr_in *)&addr;
+        inet_ntop(AF_INET, &in->sin_addr, ip, sizeof(ip));
+        port = ntohs(in->sin_port);
+    } else if (addr.ss_family == AF_INET6) {
+        const sockaddr_in6 *in6 = (const sockaddr_in6 *)&addr;
+        inet_ntop(AF_INET6, &in6->sin6_addr, ip, sizeof(ip));
+        port = ntohs(in6->sin6_port);
+    }
+    snprintf(out.text, sizeof(out.text), "%s:%d", ip, port);
+    return out;
+}
+
+// Anti-spoof check: same family, port and address bytes (and scope for IPv6 link-local)
+bool sameEndpoint(const sockaddr_storage &a, const sockaddr_storage &b) {
+    if (a.ss_family != b.ss_family) return false;
+
+    if (a.ss_family == AF_INET) {
+        const sockaddr_in *x = (const sockaddr_in *)&a, *y = (const sockaddr_in *)&b;
+        return x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
+    }
+    if (a.ss_family == AF_INET6) {
+        const sockaddr_in6 *x = (const sockaddr_in6 *)&a, *y = (const sockaddr_in6 *)&b;
+        return x->sin6_port == y->sin6_port && x->sin6_scope_id == y->sin6_scope_id &&
+               memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(in6_addr)) == 0;
+    }
+    return false;
+}
+
+// calcMessage.message values of the verdict sent back to a client
+enum ResponseCode {
+    RESPONSE_OK = 1,
+    RESPONSE_NOT_OK = 2
+};
+
+struct UringSender;
+
+// One accepted TCP connection (-T): frames are read into input, replies wait in output until the socket takes them
+struct StreamConnection {
+    int fd;
+    sockaddr_storage addr; // Peer, stands in for the datagram source address
+    socklen_t addrLen;
+    size_t inputLength = 0;
+    size_t outputSent = 0;
+    bool broken = false; // A write failed, close once the handler returns
+    bool draining = false; // The peer closed its side: nothing more to read, close once output is sent
+    vector<char> output;
+    char input[STREAM_INPUT_SIZE];
+};
+
+struct ReplyQueue {
+    vector<Datagram> packets;
+    size_t count = 0;
+    bool batched;
+    vector<mmsghdr> msgs; // sendmmsg scratch space, only used when batched
+    vector<iovec> iovs;
+    UringSender *uring = nullptr; // Set by the io_uring loop, replies then go out as SENDMSG SQEs
+    int listener = 0; // Index into ServerShard::sockets: every queued reply leaves through that socket
+    StreamConnection *stream = nullptr; // Set while a TCP connection is served, replies then go to its output
+
+    ReplyQueue(size_t capacity, bool useBatch)
+        : packets(capacity), batched(useBatch), msgs(useBatch ? capacity : 0), iovs(useBatch ? capacity : 0) {}
+
+    bool full() const { return count == packets.size(); }
 
-    ClientData() : id(0), ipAddress(""), portNumber(0), lastActivity(0) {}
+    // Final length of the reply just reserved, for encoders that only know it afterwards
+    void setLength(size_t length) { packets[count - 1].length = length; }
 
-    ClientData(int clientID, const string &ip, int port, const calcProtocol &task)
-        : id(clientID), ipAddress(ip), portNumber(port), lastActivity(time(nullptr)), assignment(task) {}
+    // Claim the next reply and return its payload, for the caller to encode into
+    char *reserve(const sockaddr_storage &clientAddr, socklen_t addrLen, size_t length, uint32_t session = 0, bool packed = false) {
+        Datagram &out = packets[count++];
+        out.addr = clientAddr;
+        out.addrLen = addrLen;
+        out.length = length;
+        out.session = session;
+        out.packed = packed;
+        return out.data;
+    }
 };
 
-map<int, ClientData> activeClients; // Track active clients
-int nextClientID = 1;
+// One worker: its own SO_REUSEPORT socket per listen address and its own slice of the
+// client table. Every ID it hands out carries its index in the top bits, so a response
+// that the kernel steers to another worker can be forwarded back through the mailbox.
+struct ServerShard {
+    int index = 0;
+    vector<int> sockets; // One per listen address, in the same order in every shard
+    vector<int> streamSockets; // -T: a TCP listener per listen address
+    unordered_set<StreamConnection *> streams; // -T: open connections, kept while the worker restarts after a failed handoff
+    int wakeFD = -1; // eventfd signalled when the mailbox gets datagrams
+    SlotArena<ClientData> activeClients; // Track active clients and issue their IDs
+    TimerWheel<uint32_t> expiryWheel{TIMER_TICK_MS, TIMER_SLOTS, monotonicMs()};
+    calcRng rng; // Private generator, assignments never touch rand()'s shared state
+    AssignmentPool pool; // Encoded assignments and their answers, refilled when the worker idles
+    ReplyCache recentReplies; // Verdicts of finished sessions, replayed to retransmitted answers
+
+    mutex mailboxLock;
+    vector<Datagram> mailbox;
+    atomic<bool> mailboxPending{false};
+
+    AdmissionTable admission; // Per-source handshake token buckets, only used with -a
+    ShardMetrics metrics; // Written only by this shard's worker
+
+    ServerShard(int shardIndex, size_t sessionCapacity, size_t poolSize, size_t replyCacheSize, uint32_t admitRate, uint32_t admitBurst)
+        : index(shardIndex), activeClients(sessionCapacity, (uint32_t)shardIndex << SHARD_ID_SHIFT, SHARD_ID_SHIFT), pool(poolSize, PROTOCOL_VERSION_MAJOR, PROTOCOL_VERSION_MINOR),
+          recentReplies(replyCacheSize, TIMEOUT_SEC * 1000), admission(ADMISSION_SOURCES, admitRate, admitBurst) {}
+};
+
+ServerShard *shards[MAX_WORKERS];
+int workerCount = 1;
+
+uint8_t secretKey[SIPHASH_KEY_SIZE]; // Per-process SipHash key, from getrandom() at startup
+
+/*
+   Handshake admission. Both checks run before any assignment is generated or any session
+   slot is touched. -a gives every source prefix a token bucket in the worker that receives
+   its datagrams; the kernel spreads one host's ports over the SO_REUSEPORT workers, so the
+   per-worker rate is the requested rate divided by the worker count. -m caps outstanding
+   sessions over all workers with one shared counter; workers check it without locking,
+   so it can overshoot by at most workerCount - 1.
+*/
+uint32_t admitRate = 0; // Handshakes per second per source, 0 = unlimited
+int admitPrefixV4 = 32, admitPrefixV6 = 64;
+size_t sessionLimit = 0; // Outstanding sessions over all workers, 0 = only the per-worker -c
+atomic<size_t> liveSessions{0};
+bool dropRejected = false; // -d: ignore refused handshakes instead of answering NOT_OK
+atomic<bool> stopping{false}; // Set by main on SIGINT/SIGTERM, workers see it when their eventfd fires
+
+// Assignments the source may have out of the wanted ones; every one costs a token
+uint32_t admitHandshake(ServerShard &shard, const sockaddr_storage &clientAddr, uint32_t wanted) {
+    if (admitRate == 0) return wanted;
+
+    uint8_t prefix[17];
+    size_t length = addressPrefix(clientAddr, admitPrefixV4, admitPrefixV6, prefix);
+    return shard.admission.admit(siphash24(secretKey, prefix, length), monotonicMs(), wanted);
+}
+
+bool sessionAvailable(ServerShard &shard) {
+    if (shard.activeClients.size() >= shard.activeClients.capacity()) return false;
+    return sessionLimit == 0 || liveSessions.load(memory_order_relaxed) < sessionLimit;
+}
+
+void endSession(ServerShard &shard, ClientData *client) {
+    shard.activeClients.release(client);
+    liveSessions.fetch_sub(1, memory_order_relaxed);
+}
+
+// An assignment that never left has no client waiting on it, so its slot is freed at once
+void releaseUnsent(ServerShard &shard, const Datagram &out) {
+    forEachHeldSession(out, [&](uint32_t id) {
+        ClientData *client = shard.activeClients.find(id);
+        if (client != nullptr) endSession(shard, client);
+    });
+}
+
+void forwardToShard(ServerShard &owner, int listener, const char *buffer, size_t length, const sockaddr_storage &clientAddr, socklen_t addrLen) {
+    {
+        lock_guard<mutex> guard(owner.mailboxLock);
+        owner.mailbox.emplace_back();
+        Datagram &packet = owner.mailbox.back();
+        packet.addr = clientAddr;
+        packet.addrLen = addrLen;
+        packet.length = length;
+        packet.listener = listener;
+        memcpy(packet.data, buffer, length);
+    }
+    owner.mailboxPending.store(true, memory_order_release);
+    uint64_t one = 1;
+    if (write(owner.wakeFD, &one, sizeof(one)) == -1) {
+        LOG(LOG_ERROR, EV_IO_ERROR, "write eventfd: %m");
+    }
+}
+
+// Both verdicts in every variant encoded once by encodeVerdicts(); a reply is a single copy.
+// Binary verdicts carry the transport in their protocol field: [0] UDP, [1] TCP.
+static char encodedVerdicts[2][RESPONSE_NOT_OK + 1][CalcMessageWire::size];
+static char encodedTextVerdicts[RESPONSE_NOT_OK + 1][TEXT_LINE_MAX];
+static size_t textVerdictLength[RESPONSE_NOT_OK + 1];
+
+void encodeVerdicts() {
+    for (uint32_t code = RESPONSE_OK; code <= RESPONSE_NOT_OK; code++) {
+        calcMessageHost verdict = {2, code, 17, PROTOCOL_VERSION_MAJOR, PROTOCOL_VERSION_MINOR};
+        encodeCalcMessage(encodedVerdicts[0][code], verdict);
+        verdict.protocol = 6;
+        encodeCalcMessage(encodedVerdicts[1][code], verdict);
+        textVerdictLength[code] = formatTextVerdict(encodedTextVerdicts[code], code);
+    }
+}
+
+// text: answer in the text variant, because the datagram being answered was a text line or a type 21 handshake
+void sendResponse(ReplyQueue &replies, const sockaddr_storage &clientAddr, socklen_t addrLen, ResponseCode response, bool text) {
+    if (text) {
+        memcpy(replies.reserve(clientAddr, addrLen, textVerdictLength[response]), encodedTextVerdicts[response], textVerdictLength[response]);
+        return;
+    }
+    memcpy(replies.reserve(clientAddr, addrLen, CalcMessageWire::size), encodedVerdicts[replies.stream != nullptr][response],
+           CalcMessageWire::size);
+}
+
+// Per-packet path: one sendto per queued reply
+void flushReplies(ServerShard &shard, ReplyQueue &replies) {
+    for (size_t i = 0; i < replies.count; i++) {
+        Datagram &out = replies.packets[i];
+        if (sendto(shard.sockets[replies.listener], out.data, out.length, 0, (struct sockaddr *)&out.addr, out.addrLen) == -1) {
+            shard.metrics.count(M_SEND_ERRORS);
+            LOG(LOG_ERROR, EV_IO_ERROR, "sendto: %m");
+            releaseUnsent(shard, out);
+        }
+    }
+    replies.count = 0;
+}
+
+// Batched path: hand every queued reply to the kernel in as few sendmmsg calls as possible
+void flushRepliesBatched(ServerShard &shard, ReplyQueue &replies) {
+    vector<mmsghdr> &msgs = replies.msgs;
+    vector<iovec> &iovs = replies.iovs;
+
+    for (size_t i = 0; i < replies.count; i++) {
+        Datagram &out = replies.packets[i];
+        iovs[i].iov_base = out.data;
+        iovs[i].iov_len = out.length;
+        memset(&msgs[i], 0, sizeof(mmsghdr));
+        msgs[i].msg_hdr.msg_name = &out.addr;
+        msgs[i].msg_hdr.msg_namelen = out.addrLen;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    size_t sent = 0;
+    while (sent < replies.count) {
+        int n = sendmmsg(shard.sockets[replies.listener], &msgs[sent], replies.count - sent, 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            shard.metrics.count(M_SEND_ERRORS);
+            LOG(LOG_ERROR, EV_IO_ERROR, "sendmmsg: %m");
+            releaseUnsent(shard, replies.packets[sent]);
+            sent++; // sendmmsg stops at the first failing datagram, skip it and send the rest
+            continue;
+        }
+        sent += n;
+    }
+    replies.count = 0;
+}
+
+/*
+   Send side of the io_uring backend. A SENDMSG SQE may be retried by the kernel after
+   the loop has moved on, so every reply is copied into a slot that stays untouched
+   until its completion arrives; the ReplyQueue itself can be refilled at once. With
+   all slots in flight the reply falls back to a plain sendto.
+*/
+enum UringTag { URING_RECV = 1, URING_WAKE = 2, URING_SEND = 3, URING_CANCEL = 4 }; // Top half of user_data
+
+struct UringSender {
+    Uring &ring;
+    vector<Datagram> slots;
+    vector<msghdr> msgs;
+    vector<iovec> iovs;
+    vector<uint32_t> freeSlots;
+
+    UringSender(Uring &uring, size_t slotCount) : ring(uring), slots(slotCount), msgs(slotCount), iovs(slotCount) {
+        for (size_t i = 0; i < slotCount; i++) freeSlots.push_back(slotCount - 1 - i);
+    }
+};
+
+void flushRepliesUring(ServerShard &shard, ReplyQueue &replies) {
+    UringSender &sender = *replies.uring;
+
+    for (size_t i = 0; i < replies.count; i++) {
+        Datagram &out = replies.packets[i];
+        io_uring_sqe *sqe = sender.freeSlots.empty() ? nullptr : sender.ring.nextSqe();
+        if (sqe == nullptr && !sender.freeSlots.empty()) {
+            sender.ring.submitAndWait(0); // Submission queue full, hand it to the kernel and retry
+            sqe = sender.ring.nextSqe();
+        }
+        if (sqe == nullptr) {
+            if (sendto(shard.sockets[replies.listener], out.data, out.length, 0, (struct sockaddr *)&out.addr, out.addrLen) == -1) {
+                shard.metrics.count(M_SEND_ERRORS);
+                LOG(LOG_ERROR, EV_IO_ERROR, "sendto: %m");
+                releaseUnsent(shard, out);
+            }
+            continue;
+        }
+
+        uint32_t slot = sender.freeSlots.back();
+        sender.freeSlots.pop_back();
+
+        Datagram &packet = sender.slots[slot];
+        copyDatagram(packet, out);
+
+        sender.iovs[slot].iov_base = packet.data;
+        sender.iovs[slot].iov_len = packet.length;
+        memset(&sender.msgs[slot], 0, sizeof(msghdr));
+        sender.msgs[slot].msg_name = &packet.addr;
+        sender.msgs[slot].msg_namelen = packet.addrLen;
+        sender.msgs[slot].msg_iov = &sender.iovs[slot];
+        sender.msgs[slot].msg_iovlen = 1;
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = shard.sockets[replies.listener];
+        sqe->addr = (uint64_t)(uintptr_t)&sender.msgs[slot];
+        sqe->len = 1;
+        sqe->user_data = ((uint64_t)URING_SEND << 32) | slot;
+    }
+    replies.count = 0;
+}
+
+// Write as much of a connection's output as the socket takes; the rest goes on the next EPOLLOUT edge
+void writeStream(ServerShard &shard, StreamConnection &conn) {
+    while (conn.outputSent < conn.output.size()) {
+        ssize_t n = send(conn.fd, &conn.output[conn.outputSent], conn.output.size() - conn.outputSent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) {
+                shard.metrics.count(M_SEND_ERRORS);
+                conn.broken = true;
+            }
+            return;
+        }
+        conn.outputSent += n;
+    }
+    conn.output.clear();
+    conn.outputSent = 0;
+}
+
+// TCP path: replies are appended to the connection's byte stream
+void flushRepliesStream(ServerShard &shard, ReplyQueue &replies) {
+    StreamConnection &conn = *replies.stream;
+    for (size_t i = 0; i < replies.count; i++) {
+        Datagram &out = replies.packets[i];
+        conn.output.insert(conn.output.end(), out.data, out.data + out.length);
+    }
+    replies.count = 0;
+    writeStream(shard, conn);
+}
+
+void flushQueued(ServerShard &shard, ReplyQueue &replies) {
+    if (replies.count == 0) return;
+    if (replies.stream) {
+        flushRepliesStream(shard, replies);
+    } else if (replies.uring) {
+        flushRepliesUring(shard, replies);
+    } else if (replies.batched) {
+        flushRepliesBatched(shard, replies);
+    } else {
+        flushReplies(shard, replies);
+    }
+}
+
+// Single compare against the answer computed for the task
+bool resultMatches(const calcExpected &expected, const char *response) {
+    if (expected.arith <= 4) {
+        return CalcProtocolWire::InResult::load(response) == expected.inResult;
+    }
+    return fabs(CalcProtocolWire::FlResult::load(response) - expected.flResult) < FLOAT_EPSILON;
+}
+
+bool textResultMatches(const calcExpected &expected, const textAnswer &answer) {
+    if (expected.arith <= 4) {
+        return answer.integral && answer.resultI == expected.inResult;
+    }
+    return fabs(answer.resultD - expected.flResult) < FLOAT_EPSILON;
+}
+
+/*
+   Stateless mode (-S): no session is stored for a handshake. The assignment ID is a
+   cookie: an 8-bit timestamp (seconds, wrapping) and 24 bits of SipHash over the key,
+   the peer address, the timestamp and the task as sent. The client echoes the task in
+   its answer, so the server recomputes the MAC and the expected result from the answer
+   alone. Memory stays constant however many handshakes arrive. A correct answer can be
+   replayed until the timestamp ages out, which only earns the same verdict again.
+*/
+bool statelessMode = false;
+
+uint32_t cookieStamp() {
+    return (monotonicMs() / 1000) & 0xFF;
+}
+
+// Operand bytes as they are on the wire: arith, inValue1, inValue2, then flValue1, flValue2
+#define COOKIE_INT_OPERANDS (CalcProtocolWire::InResult::offset - CalcProtocolWire::Arith::offset)
+#define COOKIE_FLOAT_OPERANDS (CalcProtocolWire::FlResult::offset - CalcProtocolWire::FlValue1::offset)
+
+uint32_t cookieMac(const sockaddr_storage &addr, uint32_t stamp, const char *task) {
+    struct __attribute__((__packed__)) {
+        uint16_t family;
+        uint16_t port;
+        uint8_t address[16];
+        uint8_t stamp;
+        uint8_t operands[COOKIE_INT_OPERANDS + COOKIE_FLOAT_OPERANDS];
+    } input;
+
+    memset(&input, 0, sizeof(input));
+    input.family = addr.ss_family;
+    if (addr.ss_family == AF_INET) {
+        const sockaddr_in *in = (const sockaddr_in *)&addr;
+        input.port = in->sin_port;
+        memcpy(input.address, &in->sin_addr, sizeof(in->sin_addr));
+    } else if (addr.ss_family == AF_INET6) {
+        const sockaddr_in6 *in6 = (const sockaddr_in6 *)&addr;
+        input.port = in6->sin6_port;
+        memcpy(input.address, &in6->sin6_addr, sizeof(in6->sin6_addr));
+    }
+    input.stamp = stamp;
+    memcpy(input.operands, task + CalcProtocolWire::Arith::offset, COOKIE_INT_OPERANDS);
+    memcpy(input.operands + COOKIE_INT_OPERANDS, task + CalcProtocolWire::FlValue1::offset, COOKIE_FLOAT_OPERANDS);
+
+    return (uint32_t)siphash24(secretKey, &input, sizeof(input)) & COOKIE_MAC_MASK;
+}
+
+uint32_t makeCookie(const sockaddr_storage &addr, const char *task) {
+    uint32_t stamp = cookieStamp();
+    return (stamp << COOKIE_STAMP_SHIFT) | cookieMac(addr, stamp, task);
+}
+
+// True when the ID was issued by us, to this peer, for these operands, less than TIMEOUT_SEC ago
+bool checkCookie(const sockaddr_storage &addr, uint32_t cookie, const char *response) {
+    uint32_t stamp = cookie >> COOKIE_STAMP_SHIFT;
+    if (((cookieStamp() - stamp) & 0xFF) >= TIMEOUT_SEC) return false;
+    return cookieMac(addr, stamp, response) == (cookie & COOKIE_MAC_MASK);
+}
+
+// Keyed hash of the peer and the whole answer: a cached verdict is only replayed to an identical retransmission
+uint64_t answerFingerprint(const sockaddr_storage &addr, const char *answer, size_t length) {
+    struct __attribute__((__packed__)) {
+        uint16_t family;
+        uint16_t port;
+        uint8_t address[16];
+        uint8_t answer[MAXBUFLEN];
+    } input;
 
-// Define response messages
-const calcMessage RESPONSE_NOT_OK = {htons(2), htonl(2), htonl(17), htons(PROTOCOL_VERSION_MAJOR), htons(PROTOCOL_VERSION_MINOR)};
-const calcMessage RESPONSE_OK = {htons(2), htonl(1), htonl(17), htons(PROTOCOL_VERSION_MAJOR), htons(PROTOCOL_VERSION_MINOR)};
+    memset(&input, 0, sizeof(input) - sizeof(input.answer)); // Only length bytes of the answer are hashed
+    input.family = addr.ss_family;
+    if (addr.ss_family == AF_INET) {
+        const sockaddr_in *in = (const sockaddr_in *)&addr;
+        input.port = in->sin_port;
+        memcpy(input.address, &in->sin_addr, sizeof(in->sin_addr));
+    } else if (addr.ss_family == AF_INET6) {
+        const sockaddr_in6 *in6 = (const sockaddr_in6 *)&addr;
+        input.port = in6->sin6_port;
+        memcpy(input.address, &in6->sin6_addr, sizeof(in6->sin6_addr));
+    }
+    memcpy(input.answer, answer, length);
+    return siphash24(secretKey, &input, sizeof(input) - sizeof(input.answer) + length);
+}
 
-unordered_map<string, int> opIndex = {
-    {"add", 1}, {"sub", 2}, {"mul", 3}, {"div", 4},
-    {"fadd", 5}, {"fsub", 6}, {"fmul", 7}, {"fdiv", 8}};
+// Send the verdict for an answered session, remember it for retransmissions and free the session
+void completeSession(ServerShard &shard, ClientData *client, const char *answer, size_t length, bool text, ResponseCode verdict,
+                     ReplyQueue &replies, const sockaddr_storage &clientAddr, socklen_t addrLen) {
+    sendResponse(replies, clientAddr, addrLen, verdict, text);
+    shard.recentReplies.insert(client->id, answerFingerprint(clientAddr, answer, length), verdict, monotonicMs());
+    endSession(shard, client);
+}
 
-int getArithIndex(const string &operation) {
-    return opIndex[operation];
+uint64_t clientDeadline(const ClientData &client) {
+    return client.lastActivityUs / 1000 + TIMEOUT_SEC * 1000;
 }
 
-void sendResponse(int socketFD, const sockaddr_storage &clientAddr, socklen_t addrLen, const calcMessage &response) {
-    if (sendto(socketFD, &response, sizeof(response), 0, (struct sockaddr *)&clientAddr, addrLen) == -1) {
-        perror("sendto");
+// Fire the wheel entries that are due; an entry only counts if it still matches the live session
+void cleanupTimedOutClients(ServerShard &shard) {
+    shard.expiryWheel.expire(monotonicMs(), [&shard](uint32_t clientID, uint64_t deadline) {
+        ClientData *client = shard.activeClients.find(clientID);
+        if (client == nullptr || clientDeadline(*client) != deadline) {
+            return; // Answered or replaced since this entry was scheduled
+        }
+        shard.metrics.count(M_TIMEOUTS);
+        LOG(LOG_INFO, EV_TIMEOUT, "Client %u (%s) timed out.", clientID, endpointText(client->addr).text);
+        endSession(shard, client);
+    });
+}
+
+/*
+   Version 1.1 (protocol.h): one handshake, many assignments. Each record gets a session
+   of its own, exactly as if it had come from a separate 1.0 handshake, so timeouts,
+   forwarding and spoof checks work per record; only the datagram and the verdict are
+   shared. The whole answer datagram is cached under its first record's ID.
+*/
+
+// Up to wanted pooled assignments in one datagram; the caller has checked that at least one session is free
+void sendMultiAssignments(ServerShard &shard, uint32_t wanted, ReplyQueue &replies, const sockaddr_storage &clientAddr, socklen_t addrLen) {
+    char *out = replies.reserve(clientAddr, addrLen, 0, 0, true);
+    uint64_t nowUs = monotonicUs();
+    size_t count = 0;
+
+    for (; count < wanted && (statelessMode || sessionAvailable(shard)); count++) {
+        if (shard.pool.available() == 0) shard.metrics.count(M_POOL_EMPTY);
+        size_t slot = shard.pool.take(&shard.rng);
+        char *record = out + count * CalcProtocolWire::size;
+        memcpy(record, &shard.pool.packet(slot), CalcProtocolWire::size);
+        CalcProtocolWire::MinorVersion::store(record, MULTI_VERSION_MINOR);
+
+        if (statelessMode) {
+            CalcProtocolWire::Id::store(record, makeCookie(clientAddr, record));
+            continue;
+        }
+        ClientData *client = shard.activeClients.allocate();
+        liveSessions.fetch_add(1, memory_order_relaxed);
+        CalcProtocolWire::Id::store(record, client->id);
+        memcpy(&client->assignment, record, CalcProtocolWire::size);
+        client->expected = shard.pool.expected(slot);
+        client->addr = clientAddr;
+        client->lastActivityUs = nowUs;
+        shard.expiryWheel.schedule(client->id, clientDeadline(*client));
     }
+    replies.setLength(count * CalcProtocolWire::size);
+    shard.metrics.count(M_TASKS_SENT, count);
+    LOG(LOG_DEBUG, EV_TASK_SENT, "Queued %zu calculation tasks in one datagram for %s", count, endpointText(clientAddr).text);
 }
 
-void cleanupTimedOutClients() {
-    time_t currentTime = time(nullptr);
-    for (auto it = activeClients.begin(); it != activeClients.end();) {
-        if (currentTime - it->second.lastActivity >= TIMEOUT_SEC) {
-            printf("Client %d (%s:%d) timed out.\n", it->first, it->second.ipAddress.c_str(), it->second.portNumber);
-            it = activeClients.erase(it);
+void sendMultiVerdict(ReplyQueue &replies, const sockaddr_storage &clientAddr, socklen_t addrLen, uint32_t bitmap) {
+    calcMessageHost verdict = {2, bitmap, 17, PROTOCOL_VERSION_MAJOR, MULTI_VERSION_MINOR};
+    encodeCalcMessage(replies.reserve(clientAddr, addrLen, CalcMessageWire::size), verdict);
+}
+
+// Check every record of a version 1.1 answer and reply with one bit per record
+void handleMultiAnswer(ServerShard &shard, const char *buffer, size_t count, ReplyQueue &replies, const sockaddr_storage &clientAddr, socklen_t addrLen) {
+    size_t length = count * CalcProtocolWire::size;
+    uint32_t firstID = CalcProtocolWire::Id::load(buffer);
+    uint64_t fingerprint = 0;
+
+    if (!statelessMode) {
+        int owner = firstID >> SHARD_ID_SHIFT;
+        if (owner != shard.index && owner < workerCount) {
+            forwardToShard(*shards[owner], replies.listener, buffer, length, clientAddr, addrLen);
+            shard.metrics.count(M_FORWARDED);
+            return;
+        }
+
+        uint32_t cached;
+        if (shard.recentReplies.enabled()) fingerprint = answerFingerprint(clientAddr, buffer, length);
+        if (shard.activeClients.find(firstID) == nullptr && shard.recentReplies.find(firstID, fingerprint, monotonicMs(), cached)) {
+            sendMultiVerdict(replies, clientAddr, addrLen, cached);
+            shard.metrics.count(M_DUPLICATES);
+            LOG(LOG_DEBUG, EV_DUPLICATE, "Repeated verdict for retransmitted answers from %s", endpointText(clientAddr).text);
+            return;
+        }
+    }
+
+    uint64_t nowUs = monotonicUs();
+    uint32_t bitmap = 0;
+    bool completed = false;
+
+    for (size_t i = 0; i < count; i++) {
+        const char *record = buffer + i * CalcProtocolWire::size;
+        uint32_t clientID = CalcProtocolWire::Id::load(record);
+        calcExpected expected;
+
+        if (statelessMode) {
+            calcProtocol response;
+            memcpy(&response, record, sizeof(response));
+            if (!checkCookie(clientAddr, clientID, record) || calcExpectedResult(&response, &expected) != 0) {
+                shard.metrics.count(M_INVALID_ID);
+                LOG(LOG_WARN, EV_INVALID_ID, "Client %s answered with invalid or expired ID %08x.", endpointText(clientAddr).text, clientID);
+                continue;
+            }
         } else {
-            ++it;
+            ClientData *client = shard.activeClients.find(clientID);
+            if (client == nullptr) {
+                shard.metrics.count(M_INVALID_ID);
+                LOG(LOG_WARN, EV_INVALID_ID, "Client %s with invalid ID %u tried to respond.", endpointText(clientAddr).text, clientID);
+                continue;
+            }
+            if (!sameEndpoint(client->addr, clientAddr)) {
+                shard.metrics.count(M_SPOOFED);
+                LOG(LOG_WARN, EV_SPOOF, "Client %s tried to spoof ID %u.", endpointText(clientAddr).text, clientID);
+                continue;
+            }
+            shard.metrics.answerUs.record(nowUs - client->lastActivityUs);
+            expected = client->expected;
+            endSession(shard, client);
+            completed = true;
+        }
+
+        if (resultMatches(expected, record)) {
+            bitmap |= 1u << i;
+            shard.metrics.count(M_VALID);
+        } else {
+            shard.metrics.count(M_WRONG_RESULT);
         }
     }
+
+    sendMultiVerdict(replies, clientAddr, addrLen, bitmap);
+    if (completed) shard.recentReplies.insert(firstID, fingerprint, bitmap, monotonicMs());
+    LOG(LOG_INFO, EV_VALID, "%d of %zu answers right from %s", __builtin_popcount(bitmap), count, endpointText(clientAddr).text);
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <hostname:port>\n", argv[0]);
-        exit(EXIT_FAILURE);
+// Handle one received datagram, queueing any reply instead of sending it directly
+void handleDatagram(ServerShard &shard, const char *buffer, ssize_t receivedBytes, const sockaddr_storage &clientAddr, socklen_t addrLen, ReplyQueue &replies) {
+    shard.metrics.count(M_DATAGRAMS);
+    LOG(LOG_DEBUG, EV_RECEIVED, "Message received from %s", endpointText(clientAddr).text);
+
+    calcMessageHost clientMsg;
+    bool text = isTextDatagram(buffer, receivedBytes); // Checked first, a short line could pass for a calcMessage
+    size_t multiCount = text || replies.stream ? 0 : multiRecordCount(buffer, receivedBytes, 2);
+
+    if (!text && (decodeCalcMessage(buffer, receivedBytes, clientMsg) ||
+                  (replies.stream == nullptr && decodeMultiHandshake(buffer, receivedBytes, clientMsg)))) {
+        text = clientMsg.type == PROTOCOL_TEXT_TYPE;
+        // Version 1.1 carries the number of assignments wanted in message; binary over UDP only
+        bool multi = clientMsg.type == PROTOCOL_TYPE && clientMsg.minor_version == MULTI_VERSION_MINOR && replies.stream == nullptr;
+        if ((clientMsg.type != PROTOCOL_TYPE && !text) || clientMsg.protocol != (replies.stream ? 6 : 17) ||
+            clientMsg.major_version != PROTOCOL_VERSION_MAJOR ||
+            (multi ? clientMsg.message == 0
+                   : clientMsg.message != PROTOCOL_MESSAGE || clientMsg.minor_version != PROTOCOL_VERSION_MINOR)) {
+            sendResponse(replies, clientAddr, addrLen, RESPONSE_NOT_OK, text);
+            shard.metrics.count(M_BAD_HANDSHAKES);
+            LOG(LOG_WARN, EV_BAD_HANDSHAKE, "Invalid protocol message from %s", endpointText(clientAddr).text);
+            return;
+        }
+
+        // A text answer does not echo the operands, so a cookie cannot be checked against them
+        if (text && statelessMode) {
+            sendResponse(replies, clientAddr, addrLen, RESPONSE_NOT_OK, text);
+            shard.metrics.count(M_BAD_HANDSHAKES);
+            LOG(LOG_WARN, EV_BAD_HANDSHAKE, "Text protocol requested by %s, not available with -S", endpointText(clientAddr).text);
+            return;
+        }
+
+        // No more records than the handshake had bytes, and each one is charged to the source
+        uint32_t wanted = 1;
+        if (multi) wanted = min({clientMsg.message, (uint32_t)MULTI_MAX_ITEMS, (uint32_t)multiRecordBudget(receivedBytes)});
+
+        shard.metrics.count(M_HANDSHAKES);
+        uint32_t admitted = admitHandshake(shard, clientAddr, wanted);
+        if (admitted == 0) {
+            if (!dropRejected) sendResponse(replies, clientAddr, addrLen, RESPONSE_NOT_OK, text);
+            shard.metrics.count(M_RATE_LIMITED);
+            LOG(LOG_WARN, EV_RATE_LIMITED, "Handshake rate exceeded by %s", endpointText(clientAddr).text);
+            return;
+        }
+
+        if (!statelessMode && !sessionAvailable(shard)) {
+            if (!dropRejected) sendResponse(replies, clientAddr, addrLen, RESPONSE_NOT_OK, text);
+            shard.metrics.count(M_SESSIONS_REFUSED);
+            LOG(LOG_WARN, EV_TABLE_FULL, "Session limit reached, rejecting %s", endpointText(clientAddr).text);
+            return;
+        }
+
+        if (multi) {
+            sendMultiAssignments(shard, admitted, replies, clientAddr, addrLen);
+            return;
+        }
+
+        if (shard.pool.available() == 0) shard.metrics.count(M_POOL_EMPTY);
+        size_t slot = shard.pool.take(&shard.rng);
+
+        uint32_t clientID;
+        ClientData *client = nullptr;
+
+        if (statelessMode) {
+            clientID = 0; // Set once the operands are in the packet, they are part of the cookie
+        } else {
+            client = shard.activeClients.allocate();
+            if (client == nullptr) {
+                sendResponse(replies, clientAddr, addrLen, RESPONSE_NOT_OK, text);
+                shard.metrics.count(M_SESSIONS_REFUSED);
+                LOG(LOG_WARN, EV_TABLE_FULL, "Session table full, rejecting %s", endpointText(clientAddr).text);
+                return;
+            }
+            clientID = client->id;
+            liveSessions.fetch_add(1, memory_order_relaxed);
+        }
+
+        if (text) {
+            // Formatted from the pooled datagram; the session keeps the binary form like any other
+            calcProtocolHost task;
+            decodeCalcProtocol(&shard.pool.packet(slot), CalcProtocolWire::size, task);
+            task.id = clientID;
+            char *out = replies.reserve(clientAddr, addrLen, 0, clientID);
+            replies.setLength(formatTextAssignment(out, task));
+            memcpy(&client->assignment, &shard.pool.packet(slot), CalcProtocolWire::size);
+            CalcProtocolWire::Id::store(&client->assignment, clientID);
+        } else {
+            // The pooled datagram is complete apart from the ID
+            char *out = replies.reserve(clientAddr, addrLen, CalcProtocolWire::size, clientID);
+            memcpy(out, &shard.pool.packet(slot), CalcProtocolWire::size);
+            if (statelessMode) clientID = makeCookie(clientAddr, out);
+            CalcProtocolWire::Id::store(out, clientID);
+            if (client != nullptr) memcpy(&client->assignment, out, CalcProtocolWire::size);
+        }
+        shard.metrics.count(M_TASKS_SENT);
+
+        if (statelessMode) {
+            LOG(LOG_DEBUG, EV_TASK_SENT, "Queued calculation task %08x", clientID);
+            return;
+        }
+
+        client->expected = shard.pool.expected(slot);
+        client->addr = clientAddr;
+        client->lastActivityUs = monotonicUs();
+        shard.expiryWheel.schedule(clientID, clientDeadline(*client));
+        LOG(LOG_DEBUG, EV_TASK_SENT, "Queued %s calculation task for client %u", text ? "text" : "binary", clientID);
+    } else if (multiCount != 0) {
+        handleMultiAnswer(shard, buffer, multiCount, replies, clientAddr, addrLen);
+    } else if (text || receivedBytes == (ssize_t)CalcProtocolWire::size) {
+        // Answers are read in place: only the ID and the result field are decoded
+        textAnswer textResult;
+        if (text && !parseTextAnswer(buffer, receivedBytes, textResult)) {
+            shard.metrics.count(M_BAD_SIZE);
+            return;
+        }
+        uint32_t clientID = text ? textResult.id : CalcProtocolWire::Id::load(buffer);
+        int owner = clientID >> SHARD_ID_SHIFT;
+
+        if (statelessMode && text) {
+            sendResponse(replies, clientAddr, addrLen, RESPONSE_NOT_OK, text);
+            shard.metrics.count(M_INVALID_ID);
+            LOG(LOG_WARN, EV_INVALID_ID, "Client %s sent a text answer, stateless IDs only work with binary.", endpointText(clientAddr).text);
+            return;
+        }
+
+        if (statelessMode) {
+            calcProtocol response;
+            calcExpected expected;
+            memcpy(&response, buffer, sizeof(response));
+            if (!checkCookie(clientAddr, clientID, buffer) || calcExpectedResult(&response, &expected) != 0) {
+                sendResponse(replies, clientAddr, addrLen, RESPONSE_NOT_OK, text);
+                shard.metrics.count(M_INVALID_ID);
+                LOG(LOG_WARN, EV_INVALID_ID, "Client %s answered with invalid or expired ID %08x.", endpointText(clientAddr).text, clientID);
+            } else if (!resultMatches(expected, buffer)) {
+                sendResponse(replies, clientAddr, addrLen, RESPONSE_NOT_OK, text);
+                shard.metrics.count(M_WRONG_RESULT);
+                LOG(LOG_INFO, EV_WRONG_RESULT, "Wrong result for task %08x (%s)", clientID, endpointText(clientAddr).text);
+            } else {
+                sendResponse(replies, clientAddr, addrLen, RESPONSE_OK, text);
+                shard.metrics.count(M_VALID);
+                LOG(LOG_INFO, EV_VALID, "Valid response for task %08x (%s)", clientID, endpointText(clientAddr).text);
+            }
+            return;
+        }
+
+        // A TCP answer stays here: its reply must go out on this worker's connection, and the
+        // handshake came over that same connection, so a foreign ID is not a live session anyway
+        if (owner != shard.index && owner < workerCount && replies.stream == nullptr) {
+            forwardToShard(*shards[owner], replies.listener, buffer, receivedBytes, clientAddr, addrLen);
+            shard.metrics.count(M_FORWARDED);
+            return;
+        }
+
+        ClientData *client = shard.activeClients.find(clientID);
+        if (client == nullptr && shard.recentReplies.enabled()) {
+            uint32_t verdict;
+            if (shard.recentReplies.find(clientID, answerFingerprint(clientAddr, buffer, receivedBytes), monotonicMs(), verdict)) {
+                sendResponse(replies, clientAddr, addrLen, (ResponseCode)verdict, text);
+                shard.metrics.count(M_DUPLICATES);
+                LOG(LOG_DEBUG, EV_DUPLICATE, "Repeated verdict for retransmitted answer from client %u (%s)", clientID, endpointText(clientAddr).text);
+                return;
+            }
+        }
+        if (client == nullptr) {
+            sendResponse(replies, clientAddr, addrLen, RESPONSE_NOT_OK, text);
+            shard.metrics.count(M_INVALID_ID);
+            LOG(LOG_WARN, EV_INVALID_ID, "Client %s with invalid ID %u tried to respond.", endpointText(clientAddr).text, clientID);
+            return;
+        }
+
+        if (!sameEndpoint(client->addr, clientAddr)) {
+            sendResponse(replies, clientAddr, addrLen, RESPONSE_NOT_OK, text);
+            shard.metrics.count(M_SPOOFED);
+            LOG(LOG_WARN, EV_SPOOF, "Client %s tried to spoof ID %u.", endpointText(clientAddr).text, clientID);
+            return;
+        }
+
+        shard.metrics.answerUs.record(monotonicUs() - client->lastActivityUs);
+
+        bool correct = text ? textResultMatches(client->expected, textResult) : resultMatches(client->expected, buffer);
+        if (!correct) {
+            shard.metrics.count(M_WRONG_RESULT);
+            LOG(LOG_INFO, EV_WRONG_RESULT, "Wrong result from client %u (%s)", clientID, endpointText(client->addr).text);
+            completeSession(shard, client, buffer, receivedBytes, text, RESPONSE_NOT_OK, replies, clientAddr, addrLen);
+            return;
+        }
+
+        shard.metrics.count(M_VALID);
+        LOG(LOG_INFO, EV_VALID, "Valid response from client %u (%s)", clientID, endpointText(client->addr).text);
+        completeSession(shard, client, buffer, receivedBytes, text, RESPONSE_OK, replies, clientAddr, addrLen);
+    } else {
+        shard.metrics.count(M_BAD_SIZE);
     }
+}
 
-    initCalcLib();
 
-    printf("Starting server...\n");
+// Handle responses that other shards received for IDs this shard issued
+void drainMailbox(ServerShard &shard, ReplyQueue &replies) {
+    vector<Datagram> pending;
+    {
+        lock_guard<mutex> guard(shard.mailboxLock);
+        pending.swap(shard.mailbox);
+        shard.mailboxPending.store(false, memory_order_relaxed);
+    }
 
-    char *hostName = strtok(argv[1], ":");
-    char *portString = strtok(NULL, ":");
+    for (Datagram &packet : pending) {
+        if (packet.listener != replies.listener) {
+            flushQueued(shard, replies); // Replies leave through the socket the answer arrived on
+            replies.listener = packet.listener;
+        }
+        handleDatagram(shard, packet.data, packet.length, packet.addr, packet.addrLen, replies);
+        if (replies.full()) flushQueued(shard, replies);
+    }
+    flushQueued(shard, replies);
+}
 
-    if (!portString) {
-        fprintf(stderr, "Error: Invalid host:port format.\n");
-        exit(EXIT_FAILURE);
+// Reset the eventfd that other shards, and main at shutdown, signal
+void clearWake(ServerShard &shard) {
+    uint64_t count;
+    if (read(shard.wakeFD, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        LOG(LOG_ERROR, EV_IO_ERROR, "read eventfd: %m");
     }
+}
+
+/*
+   Receive handlers for the socket backends. The reactor calls one on every readable
+   edge of a listen socket, with replies.listener naming the socket. It drains with
+   MSG_DONTWAIT until EAGAIN, or stops after DRAIN_BUDGET receive calls and returns
+   true so the reactor comes back to it after the other sockets and timers.
+*/
 
-    struct addrinfo hints = {}, *serverInfo, *p;
-    int serverSocket;
+// Original path: one recvfrom and one sendto per datagram
+bool drainPerPacket(ServerShard &shard, ReplyQueue &replies) {
     struct sockaddr_storage clientAddr;
-    socklen_t addrLen = sizeof(clientAddr);
+    socklen_t addrLen;
     char buffer[MAXBUFLEN];
+    int socketFD = shard.sockets[replies.listener];
 
-    hints.ai_family = AF_UNSPEC; // Support both IPv4 and IPv6
-    hints.ai_socktype = SOCK_DGRAM; // UDP
-    hints.ai_flags = AI_PASSIVE;
+    for (int i = 0; i < DRAIN_BUDGET; i++) {
+        uint64_t batchStart = monotonicUs();
+        addrLen = sizeof(clientAddr);
+        ssize_t receivedBytes = recvfrom(socketFD, buffer, MAXBUFLEN - 1, MSG_DONTWAIT, (struct sockaddr *)&clientAddr, &addrLen);
 
-    if (getaddrinfo(hostName, portString, &hints, &serverInfo) != 0) {
-        perror("getaddrinfo");
-        exit(EXIT_FAILURE);
+        if (receivedBytes == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+            if (errno != EINTR) {
+                shard.metrics.count(M_RECV_ERRORS);
+                LOG(LOG_ERROR, EV_IO_ERROR, "recvfrom: %m");
+            }
+            continue;
+        }
+
+        handleDatagram(shard, buffer, receivedBytes, clientAddr, addrLen, replies);
+        flushQueued(shard, replies);
+        shard.metrics.batchUs.record(monotonicUs() - batchStart);
     }
+    return true;
+}
 
-    for (p = serverInfo; p != NULL; p = p->ai_next) {
-        if ((serverSocket = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
-            perror("socket");
+// recvmmsg scratch space of one worker
+struct RecvBatch {
+    vector<sockaddr_storage> addrs;
+    vector<char> buffers;
+    vector<iovec> iovs;
+    vector<mmsghdr> msgs;
+
+    explicit RecvBatch(size_t batchSize) : addrs(batchSize), buffers(batchSize * MAXBUFLEN), iovs(batchSize), msgs(batchSize) {
+        for (size_t i = 0; i < batchSize; i++) {
+            iovs[i].iov_base = &buffers[i * MAXBUFLEN];
+            iovs[i].iov_len = MAXBUFLEN - 1;
+        }
+    }
+};
+
+// Batched path: up to batchSize datagrams per recvmmsg, all replies flushed with sendmmsg
+bool drainBatched(ServerShard &shard, RecvBatch &batch, ReplyQueue &replies) {
+    size_t batchSize = batch.msgs.size();
+    int socketFD = shard.sockets[replies.listener];
+
+    for (int round = 0; round < DRAIN_BUDGET; round++) {
+        for (size_t i = 0; i < batchSize; i++) {
+            memset(&batch.msgs[i], 0, sizeof(mmsghdr));
+            batch.msgs[i].msg_hdr.msg_name = &batch.addrs[i];
+            batch.msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+            batch.msgs[i].msg_hdr.msg_iov = &batch.iovs[i];
+            batch.msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        uint64_t batchStart = monotonicUs();
+        int received = recvmmsg(socketFD, batch.msgs.data(), batchSize, MSG_DONTWAIT, NULL);
+
+        if (received == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+            if (errno != EINTR) {
+                shard.metrics.count(M_RECV_ERRORS);
+                LOG(LOG_ERROR, EV_IO_ERROR, "recvmmsg: %m");
+            }
             continue;
         }
 
-        if (bind(serverSocket, p->ai_addr, p->ai_addrlen) == -1) {
-            close(serverSocket);
-            perror("bind");
+        for (int i = 0; i < received; i++) {
+            handleDatagram(shard, &batch.buffers[i * MAXBUFLEN], batch.msgs[i].msg_len, batch.addrs[i],
+                           batch.msgs[i].msg_hdr.msg_namelen, replies);
+        }
+        flushQueued(shard, replies);
+        shard.metrics.batchUs.record(monotonicUs() - batchStart);
+
+        // A short batch emptied the queue; the next datagram raises a new edge, so skip the EAGAIN call
+        if ((size_t)received < batchSize) return false;
+    }
+    return true;
+}
+
+/*
+   TCP transport (-T). Every worker has its own SO_REUSEPORT listener per address, so
+   the kernel spreads connections over workers, and a connection stays with the worker
+   that accepted it. Frames are cut from the byte stream by their type field
+   (streamFrameSize) and go through handleDatagram() with the peer address, so
+   sessions, verification and the reply cache are the same as for UDP. A client may
+   pipeline any number of handshakes and answers; they are handled, and answered, in
+   order. A connection whose unsent replies pass STREAM_OUTPUT_LIMIT is not read again
+   until the socket has taken them, which pushes back on the client through TCP. A
+   client that shuts down its side after the last request still gets every reply: the
+   connection is shut down for reading and closed once its output has drained.
+   Connections belong to the shard, not to one run of its loop, so a worker restarted
+   after a failed handoff picks them up where it stopped.
+*/
+
+void closeStream(Reactor &reactor, unordered_set<StreamConnection *> &connections, StreamConnection *conn) {
+    LOG(LOG_DEBUG, EV_CONNECTION, "Connection from %s closed", endpointText(conn->addr).text);
+    reactor.unwatch(conn->fd);
+    close(conn->fd);
+    connections.erase(conn);
+    delete conn;
+}
+
+// Handle every complete frame in the input buffer; false on a frame type that cannot be on this stream
+bool handleStreamFrames(ServerShard &shard, StreamConnection &conn, ReplyQueue &replies) {
+    size_t offset = 0;
+    while (true) {
+        size_t size = streamFrameSize(conn.input + offset, conn.inputLength - offset, true);
+        if (size == STREAM_FRAME_INVALID) {
+            shard.metrics.count(M_BAD_SIZE);
+            return false;
+        }
+        if (size == 0 || size > conn.inputLength - offset) break;
+        handleDatagram(shard, conn.input + offset, size, conn.addr, conn.addrLen, replies);
+        if (replies.full()) flushQueued(shard, replies);
+        offset += size;
+    }
+    conn.inputLength -= offset;
+    memmove(conn.input, conn.input + offset, conn.inputLength);
+    return true;
+}
+
+// Reactor handler of one connection: send what is pending, then read until EAGAIN or the budget is spent
+bool serveStream(ServerShard &shard, Reactor &reactor, unordered_set<StreamConnection *> &connections,
+                 StreamConnection *conn, ReplyQueue &replies) {
+    replies.stream = conn;
+    writeStream(shard, *conn);
+
+    bool more = false, open = !conn->broken;
+    for (int i = 0; open && !conn->draining && i < DRAIN_BUDGET; i++) {
+        if (conn->output.size() - conn->outputSent >= STREAM_OUTPUT_LIMIT) break; // Resumed by the EPOLLOUT edge
+
+        ssize_t n = recv(conn->fd, conn->input + conn->inputLength, STREAM_INPUT_SIZE - conn->inputLength, MSG_DONTWAIT);
+        if (n == 0) {
+            shutdown(conn->fd, SHUT_RD); // Half-close: the replies still queued go out on the EPOLLOUT edges
+            conn->draining = true;
+            break;
+        }
+        if (n == -1 && errno != EAGAIN && errno != EINTR) {
+            shard.metrics.count(M_RECV_ERRORS);
+            open = false;
+            break;
+        }
+        if (n == -1) break;
+
+        conn->inputLength += n;
+        open = handleStreamFrames(shard, *conn, replies);
+        flushQueued(shard, replies);
+        open = open && !conn->broken;
+        more = i == DRAIN_BUDGET - 1;
+    }
+
+    replies.stream = nullptr;
+    if (!open || (conn->draining && conn->output.empty())) {
+        closeStream(reactor, connections, conn);
+        return false;
+    }
+    return more;
+}
+
+// Put a connection on the reactor; serveStream() runs on every edge
+bool watchStream(ServerShard &shard, Reactor &reactor, unordered_set<StreamConnection *> &connections, StreamConnection *conn,
+                 ReplyQueue &replies) {
+    return reactor.watch(conn->fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, [&shard, &reactor, &connections, conn, &replies](uint32_t) {
+        return serveStream(shard, reactor, connections, conn, replies);
+    });
+}
+
+// Reactor handler of a TCP listener: accept what is waiting and put each connection on the reactor
+bool acceptStreams(ServerShard &shard, Reactor &reactor, unordered_set<StreamConnection *> &connections, int listenFD,
+                   ReplyQueue &replies) {
+    for (int i = 0; i < DRAIN_BUDGET; i++) {
+        StreamConnection *conn = new StreamConnection();
+        conn->addrLen = sizeof(conn->addr);
+        conn->fd = accept4(listenFD, (struct sockaddr *)&conn->addr, &conn->addrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (conn->fd == -1) {
+            delete conn;
+            if (errno == EAGAIN || errno == EINTR) return false;
+            shard.metrics.count(M_RECV_ERRORS);
+            LOG(LOG_ERROR, EV_IO_ERROR, "accept: %m");
+            return false; // EMFILE and the like: wait for the next connection to retry
+        }
+
+        int one = 1;
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // Replies are whole frames already
+        if (!watchStream(shard, reactor, connections, conn, replies)) {
+            LOG(LOG_ERROR, EV_IO_ERROR, "epoll_ctl: %m");
+            close(conn->fd);
+            delete conn;
             continue;
         }
-        break;
+        connections.insert(conn);
+        shard.metrics.count(M_CONNECTIONS);
+        LOG(LOG_DEBUG, EV_CONNECTION, "Connection from %s", endpointText(conn->addr).text);
     }
+    return true;
+}
 
-    if (p == NULL) {
-        fprintf(stderr, "Failed to bind socket.\n");
-        exit(EXIT_FAILURE);
+// Socket backends: the listen sockets, TCP connections, the wake eventfd and the expiry timer on one reactor
+void serveReactor(ServerShard &shard, size_t batchSize) {
+    Reactor reactor;
+    if (!reactor.init()) {
+        LOG(LOG_ERROR, EV_IO_ERROR, "worker %d: epoll_create1: %m", shard.index);
+        return;
     }
 
-    freeaddrinfo(serverInfo);
+    ReplyQueue replies(batchSize, batchSize > 1);
+    RecvBatch batch(batchSize > 1 ? batchSize : 0);
+
+    for (size_t i = 0; i < shard.sockets.size(); i++) {
+        int listener = i;
+        reactor.watch(shard.sockets[i], EPOLLIN, [&shard, &batch, &replies, listener](uint32_t) {
+            replies.listener = listener;
+            return batch.msgs.empty() ? drainPerPacket(shard, replies) : drainBatched(shard, batch, replies);
+        });
+    }
+
+    ReplyQueue streamReplies(batchSize, false);
+    unordered_set<StreamConnection *> &connections = shard.streams;
+    for (StreamConnection *conn : vector<StreamConnection *>(connections.begin(), connections.end())) {
+        // Still open from before a failed handoff; the first edge sends what is pending and reads what arrived
+        if (!watchStream(shard, reactor, connections, conn, streamReplies)) {
+            LOG(LOG_ERROR, EV_IO_ERROR, "epoll_ctl: %m");
+            close(conn->fd);
+            connections.erase(conn);
+            delete conn;
+        }
+    }
+    for (int listenFD : shard.streamSockets) {
+        reactor.watch(listenFD, EPOLLIN, [&shard, &reactor, &connections, listenFD, &streamReplies](uint32_t) {
+            return acceptStreams(shard, reactor, connections, listenFD, streamReplies);
+        });
+    }
+
+    reactor.watch(shard.wakeFD, EPOLLIN, [&shard, &reactor, &replies](uint32_t) {
+        clearWake(shard);
+        if (stopping.load(memory_order_acquire)) {
+            reactor.stop();
+        } else if (shard.mailboxPending.load(memory_order_acquire)) {
+            drainMailbox(shard, replies);
+        }
+        return false;
+    });
+
+    if (reactor.addTimer(TIMER_TICK_MS, [&shard]() { cleanupTimedOutClients(shard); }) == -1) {
+        LOG(LOG_ERROR, EV_IO_ERROR, "worker %d: timerfd: %m", shard.index);
+        return;
+    }
+
+    // About to block: top up the assignment pool first
+    reactor.setIdle([&shard]() { shard.pool.refill(&shard.rng); });
+    reactor.run();
+}
+
+/*
+   io_uring loop (-U): one multishot RECVMSG per listen socket keeps receiving into
+   provided buffers and a multishot poll watches the mailbox eventfd, so the steady state is a single
+   io_uring_enter per iteration that submits the previous round's replies and waits for
+   new completions (bounded by the timer wheel). Datagrams go through the same
+   handleDatagram() as the socket loops.
+*/
+void armUringRecv(Uring &ring, ServerShard &shard, msghdr &recvHeader, int listener) {
+    io_uring_sqe *sqe = ring.nextSqe();
+    if (sqe == nullptr) {
+        ring.submitAndWait(0);
+        sqe = ring.nextSqe();
+    }
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = shard.sockets[listener];
+    sqe->addr = (uint64_t)(uintptr_t)&recvHeader;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = ((uint64_t)URING_RECV << 32) | listener;
+}
+
+void armUringWake(Uring &ring, ServerShard &shard) {
+    io_uring_sqe *sqe = ring.nextSqe();
+    if (sqe == nullptr) {
+        ring.submitAndWait(0);
+        sqe = ring.nextSqe();
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = shard.wakeFD;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = (uint64_t)URING_WAKE << 32;
+}
+
+// Ask the kernel to end a listener's multishot receive; its last completion comes without IORING_CQE_F_MORE
+void cancelUringRecv(Uring &ring, int listener) {
+    io_uring_sqe *sqe = ring.nextSqe();
+    if (sqe == nullptr) {
+        ring.submitAndWait(0);
+        sqe = ring.nextSqe();
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = ((uint64_t)URING_RECV << 32) | listener;
+    sqe->user_data = (uint64_t)URING_CANCEL << 32;
+}
+
+// Hand one multishot receive completion to handleDatagram
+void handleUringRecv(ServerShard &shard, Uring &ring, const msghdr &recvHeader, const io_uring_cqe &cqe, ReplyQueue &replies) {
+    if (!(cqe.flags & IORING_CQE_F_BUFFER)) return;
+    uint16_t bufferID = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    char *buffer = ring.buffer(bufferID);
+
+    // Buffer layout: io_uring_recvmsg_out, then the peer address area, then the payload
+    const io_uring_recvmsg_out *out = (const io_uring_recvmsg_out *)buffer;
+    const char *payload = buffer + sizeof(io_uring_recvmsg_out) + recvHeader.msg_namelen + recvHeader.msg_controllen;
+    size_t room = ring.bufferLength() - (payload - buffer);
+
+    sockaddr_storage clientAddr;
+    socklen_t addrLen = out->namelen < sizeof(clientAddr) ? out->namelen : sizeof(clientAddr);
+    memcpy(&clientAddr, buffer + sizeof(io_uring_recvmsg_out), addrLen);
+
+    size_t length = out->payloadlen < room ? out->payloadlen : room; // Truncated datagrams fail the size checks
+    int listener = (uint32_t)cqe.user_data;
+    if (listener != replies.listener) {
+        flushQueued(shard, replies);
+        replies.listener = listener;
+    }
+    handleDatagram(shard, payload, length, clientAddr, addrLen, replies);
+    if (replies.full()) flushQueued(shard, replies);
+
+    ring.recycleBuffer(bufferID);
+}
 
-    printf("Server is ready.\n");
+void serveUring(ServerShard &shard, size_t batchSize, Uring &ring) {
+    UringSender sender(ring, batchSize * 4);
+    ReplyQueue replies(batchSize, false);
+    replies.uring = &sender;
+
+    msghdr recvHeader;
+    memset(&recvHeader, 0, sizeof(recvHeader));
+    recvHeader.msg_namelen = sizeof(sockaddr_storage);
+
+    vector<bool> recvArmed(shard.sockets.size(), false);
+    bool wakeArmed = false;
+    bool cancelling = false; // Stopping: receives cancelled, finishing what they already took off the sockets
 
     while (true) {
-        cleanupTimedOutClients();
+        // A datagram in a completion has left its socket, so it is handled before the worker
+        // exits, as are the sends in flight; the sockets may go on in another process (-H)
+        if (!cancelling && stopping.load(memory_order_acquire)) {
+            for (size_t i = 0; i < recvArmed.size(); i++) {
+                if (recvArmed[i]) cancelUringRecv(ring, i);
+            }
+            cancelling = true;
+        }
+        if (cancelling && find(recvArmed.begin(), recvArmed.end(), true) == recvArmed.end() &&
+            sender.freeSlots.size() == sender.slots.size()) {
+            break;
+        }
 
-        memset(buffer, 0, sizeof(buffer));
-        ssize_t receivedBytes = recvfrom(serverSocket, buffer, MAXBUFLEN - 1, 0, (struct sockaddr *)&clientAddr, &addrLen);
+        cleanupTimedOutClients(shard);
 
-        if (receivedBytes == -1) {
-            perror("recvfrom");
-            continue;
+        for (size_t i = 0; i < recvArmed.size(); i++) {
+            if (recvArmed[i] || cancelling) continue;
+            armUringRecv(ring, shard, recvHeader, i);
+            recvArmed[i] = true;
+        }
+        if (!wakeArmed) {
+            armUringWake(ring, shard);
+            wakeArmed = true;
         }
 
-        char clientIP[INET6_ADDRSTRLEN];
-        inet_ntop(clientAddr.ss_family,
-                  clientAddr.ss_family == AF_INET
-                      ? (void *)&(((struct sockaddr_in *)&clientAddr)->sin_addr)
-                      : (void *)&(((struct sockaddr_in6 *)&clientAddr)->sin6_addr),
-                  clientIP, sizeof(clientIP));
-        int clientPort = ntohs(((struct sockaddr_in *)&clientAddr)->sin_port);
+        if (shard.mailboxPending.load(memory_order_acquire)) drainMailbox(shard, replies);
 
-        printf("Message received from %s:%d\n", clientIP, clientPort);
+        // Completions only show up inside the enter below, so this is the ring's idle point
+        shard.pool.refill(&shard.rng);
+        int submitted = ring.submitAndWait(cancelling ? URING_STOP_POLL_MS : shard.expiryWheel.nextTimeout(monotonicMs()));
+        if (submitted < 0) {
+            shard.metrics.count(M_RECV_ERRORS);
+            LOG(LOG_ERROR, EV_IO_ERROR, "io_uring_enter: %s", strerror(-submitted));
+            continue;
+        }
 
-        if (receivedBytes == sizeof(calcMessage)) {
-            struct calcMessage clientMsg;
-            memcpy(&clientMsg, buffer, sizeof(clientMsg));
+        uint64_t batchStart = monotonicUs();
+        unsigned ready = ring.cqReady();
+        bool received = false;
 
-            clientMsg.type = ntohs(clientMsg.type);
-            clientMsg.message = ntohl(clientMsg.message);
-            clientMsg.protocol = ntohs(clientMsg.protocol);
-            clientMsg.major_version = ntohs(clientMsg.major_version);
-            clientMsg.minor_version = ntohs(clientMsg.minor_version);
+        for (unsigned i = 0; i < ready; i++) {
+            const io_uring_cqe &cqe = *ring.cqAt(i);
+            uint32_t tag = cqe.user_data >> 32;
 
-            if (clientMsg.type != PROTOCOL_TYPE || clientMsg.message != PROTOCOL_MESSAGE ||
-                clientMsg.protocol != 17 || clientMsg.major_version != PROTOCOL_VERSION_MAJOR ||
-                clientMsg.minor_version != PROTOCOL_VERSION_MINOR) {
-                sendResponse(serverSocket, clientAddr, addrLen, RESPONSE_NOT_OK);
-                printf("Invalid protocol message from %s:%d\n", clientIP, clientPort);
-                continue;
+            if (tag == URING_RECV) {
+                if (cqe.res >= 0) {
+                    handleUringRecv(shard, ring, recvHeader, cqe, replies);
+                    received = true;
+                } else if (cqe.res != -ENOBUFS && cqe.res != -ECANCELED) { // Out of buffers just ends the multishot, rearmed below
+                    shard.metrics.count(M_RECV_ERRORS);
+                    LOG(LOG_ERROR, EV_IO_ERROR, "recvmsg: %s", strerror(-cqe.res));
+                }
+                if (!(cqe.flags & IORING_CQE_F_MORE)) recvArmed[(uint32_t)cqe.user_data] = false;
+            } else if (tag == URING_WAKE) {
+                clearWake(shard);
+                if (!(cqe.flags & IORING_CQE_F_MORE)) wakeArmed = false;
+            } else if (tag == URING_SEND) {
+                sender.freeSlots.push_back((uint32_t)cqe.user_data);
+                if (cqe.res < 0) {
+                    shard.metrics.count(M_SEND_ERRORS);
+                    LOG(LOG_ERROR, EV_IO_ERROR, "sendmsg: %s", strerror(-cqe.res));
+                    releaseUnsent(shard, sender.slots[(uint32_t)cqe.user_data]);
+                }
             }
+        }
 
-            string operation = randomType();
-            calcProtocol newTask = {};
-            newTask.type = htonl(1);
-            newTask.major_version = htonl(PROTOCOL_VERSION_MAJOR);
-            newTask.minor_version = htonl(PROTOCOL_VERSION_MINOR);
-            newTask.id = htonl(nextClientID);
-            newTask.arith = htonl(getArithIndex(operation));
+        ring.cqAdvance(ready);
+        ring.publishBuffers();
+        flushQueued(shard, replies);
+        if (received) shard.metrics.batchUs.record(monotonicUs() - batchStart);
+    }
+}
 
-            if (operation[0] == 'f') {
-                newTask.flValue1 = randomFloat();
-                newTask.flValue2 = randomFloat();
-            } else {
-                newTask.inValue1 = htonl(randomInt());
-                newTask.inValue2 = htonl(randomInt());
+// One resolved listen address; every shard binds its own socket to each of them
+struct ListenAddress {
+    sockaddr_storage addr;
+    socklen_t addrLen;
+};
+
+// Split "host:port", "[v6 address]:port", ":port" or "*:port" in place; host is NULL for all local addresses
+bool splitHostPort(char *text, char **host, char **port) {
+    char *colon;
+    if (text[0] == '[') {
+        char *end = strchr(text, ']');
+        if (end == NULL || end[1] != ':') return false;
+        *end = '\0';
+        *host = text + 1;
+        colon = end + 1;
+    } else {
+        colon = strrchr(text, ':'); // The last colon, so an unbracketed IPv6 address still works
+        if (colon == NULL) return false;
+        *host = text;
+    }
+    *colon = '\0';
+    *port = colon + 1;
+    if (**port == '\0') return false;
+    if (**host == '\0' || strcmp(*host, "*") == 0) *host = NULL;
+    return true;
+}
+
+// Append every address an argument resolves to, e.g. both 0.0.0.0 and :: for "*:port"
+bool resolveListenAddress(char *argument, vector<ListenAddress> &addresses) {
+    char *hostName, *portString;
+    if (!splitHostPort(argument, &hostName, &portString)) {
+        fprintf(stderr, "Error: Invalid host:port format.\n");
+        return false;
+    }
+
+    struct addrinfo hints = {}, *serverInfo;
+    hints.ai_family = AF_UNSPEC; // Support both IPv4 and IPv6
+    hints.ai_socktype = SOCK_DGRAM; // UDP
+    hints.ai_flags = AI_PASSIVE;
+
+    int status = getaddrinfo(hostName, portString, &hints, &serverInfo);
+    if (status != 0) {
+        fprintf(stderr, "Error: cannot resolve %s: %s\n", hostName ? hostName : "*", gai_strerror(status));
+        return false;
+    }
+    for (struct addrinfo *p = serverInfo; p != NULL; p = p->ai_next) {
+        ListenAddress address;
+        memcpy(&address.addr, p->ai_addr, p->ai_addrlen);
+        address.addrLen = p->ai_addrlen;
+        addresses.push_back(address);
+    }
+    freeaddrinfo(serverInfo);
+    return true;
+}
+
+// type is SOCK_DGRAM, or SOCK_STREAM for a non-blocking TCP listener
+int openServerSocket(const ListenAddress &address, bool reusePort, int type) {
+    int serverSocket = socket(address.addr.ss_family, type | SOCK_CLOEXEC, 0);
+    if (serverSocket == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    int one = 1;
+    // Keep IPv6 sockets to IPv6, so "[::]:port" and "0.0.0.0:port" can be bound side by side
+    if (address.addr.ss_family == AF_INET6 && setsockopt(serverSocket, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one)) == -1) {
+        perror("setsockopt IPV6_V6ONLY");
+    }
+    if (reusePort && setsockopt(serverSocket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+        perror("setsockopt SO_REUSEPORT");
+        close(serverSocket);
+        return -1;
+    }
+    // Restarting must not wait for the previous run's connections to leave TIME_WAIT
+    if (type == SOCK_STREAM && setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1) {
+        perror("setsockopt SO_REUSEADDR");
+    }
+
+    if (bind(serverSocket, (const struct sockaddr *)&address.addr, address.addrLen) == -1) {
+        perror("bind");
+        close(serverSocket);
+        return -1;
+    }
+    if (type == SOCK_STREAM && (listen(serverSocket, STREAM_BACKLOG) == -1 || fcntl(serverSocket, F_SETFL, O_NONBLOCK) == -1)) {
+        perror("listen");
+        close(serverSocket);
+        return -1;
+    }
+    return serverSocket;
+}
+
+// -i: one log line per interval with the traffic since the previous one, summed over workers
+struct TrafficSummary {
+    uint64_t lastUs = monotonicUs();
+    uint64_t last[M_COUNTER_COUNT] = {};
+
+    void log() {
+        uint64_t total[M_COUNTER_COUNT] = {};
+        for (int i = 0; i < workerCount; i++) {
+            for (int c = 0; c < M_COUNTER_COUNT; c++) total[c] += shards[i]->metrics.counters[c].load(memory_order_relaxed);
+        }
+
+        uint64_t now = monotonicUs();
+        double seconds = (now - lastUs) / 1e6;
+        LOG(LOG_INFO, EV_STATS, "Traffic: %.0f datagrams/s, %.0f assignments/s, %.0f valid/s, %.0f wrong/s, %llu timeouts, %zu sessions",
+            (total[M_DATAGRAMS] - last[M_DATAGRAMS]) / seconds, (total[M_TASKS_SENT] - last[M_TASKS_SENT]) / seconds,
+            (total[M_VALID] - last[M_VALID]) / seconds, (total[M_WRONG_RESULT] - last[M_WRONG_RESULT]) / seconds,
+            (unsigned long long)(total[M_TIMEOUTS] - last[M_TIMEOUTS]), liveSessions.load(memory_order_relaxed));
+        memcpy(last, total, sizeof(last));
+        lastUs = now;
+    }
+};
+
+/*
+   Hot restart (-H path). A server started with -H listens for its successor on a Unix
+   socket at path (handoff.h). A new server started with the same -H connects to it
+   before opening any socket and sends its layout; when that matches (workers, listen
+   addresses, -T and -c, which fix the sockets and the shape of the session IDs), the
+   running server accepts by sending the layout back. Once the new server answers that
+   it is ready, the running server stops its workers, leaving every unread datagram in
+   its socket's queue, and sends its sockets with a snapshot:
+
+       the SipHash key, so cookies and cached fingerprints stay valid
+       per worker: the session arena's bookkeeping, the live sessions, and the answers
+       other workers forwarded that are still waiting in its mailbox
+
+   The new server restores the snapshot and confirms it took over; only then does the
+   old one exit. If the new server goes away or any step fails before that, the old
+   server restarts its workers on the sockets it still holds and serves on. The new
+   server serves the same sockets with the same sessions, so clients never see the
+   switch, and then listens at path for the next upgrade. Open TCP connections stay
+   with the old server, which serves them on if the handoff fails and closes them when
+   it exits; the TCP listen sockets and their accept queues carry over. A layout mismatch
+   leaves the running server as it was and the new one exits.
+*/
+#define HANDOFF_MAGIC 0x43414C43 // "CALC"
+#define HANDOFF_VERSION 1
+
+// What the two processes must agree on, compared byte for byte
+vector<char> handoffLayout(size_t addressCount, bool useStreams, size_t sessionCapacity) {
+    HandoffWriter out;
+    out.put((uint32_t)HANDOFF_MAGIC);
+    out.put((uint32_t)HANDOFF_VERSION);
+    out.put((uint32_t)workerCount);
+    out.put((uint32_t)addressCount);
+    out.put((uint32_t)useStreams);
+    out.put((uint64_t)sessionCapacity);
+    return out.data;
+}
+
+// A peer address without the padding of sockaddr_storage: family, port, address, IPv6 scope
+void putEndpoint(HandoffWriter &out, const sockaddr_storage &addr) {
+    uint16_t port = 0;
+    uint8_t address[16] = {};
+    uint32_t scope = 0;
+    if (addr.ss_family == AF_INET) {
+        const sockaddr_in *in = (const sockaddr_in *)&addr;
+        port = in->sin_port;
+        memcpy(address, &in->sin_addr, sizeof(in->sin_addr));
+    } else if (addr.ss_family == AF_INET6) {
+        const sockaddr_in6 *in6 = (const sockaddr_in6 *)&addr;
+        port = in6->sin6_port;
+        memcpy(address, &in6->sin6_addr, sizeof(in6->sin6_addr));
+        scope = in6->sin6_scope_id;
+    }
+    out.put((uint16_t)addr.ss_family);
+    out.put(port);
+    out.put(address);
+    out.put(scope);
+}
+
+sockaddr_storage getEndpoint(HandoffReader &in) {
+    sockaddr_storage addr;
+    memset(&addr, 0, sizeof(addr));
+    uint16_t family = in.get<uint16_t>();
+    uint16_t port = in.get<uint16_t>();
+    uint8_t address[16];
+    in.get(address, sizeof(address));
+    uint32_t scope = in.get<uint32_t>();
+
+    addr.ss_family = family;
+    if (family == AF_INET) {
+        sockaddr_in *in4 = (sockaddr_in *)&addr;
+        in4->sin_port = port;
+        memcpy(&in4->sin_addr, address, sizeof(in4->sin_addr));
+    } else if (family == AF_INET6) {
+        sockaddr_in6 *in6 = (sockaddr_in6 *)&addr;
+        in6->sin6_port = port;
+        memcpy(&in6->sin6_addr, address, sizeof(in6->sin6_addr));
+        in6->sin6_scope_id = scope;
+    }
+    return addr;
+}
+
+// Workers must have stopped: the shards are read without locks
+vector<char> handoffSnapshot() {
+    HandoffWriter out;
+    out.put(secretKey);
+    for (int i = 0; i < workerCount; i++) {
+        ServerShard &shard = *shards[i];
+        vector<uint32_t> slots = shard.activeClients.exportSlots();
+        out.put((uint64_t)slots.size());
+        out.put(slots.data(), slots.size() * sizeof(uint32_t));
+
+        out.put((uint64_t)shard.activeClients.size());
+        shard.activeClients.forEach([&out](const ClientData &client) {
+            out.put(client.id);
+            out.put(client.lastActivityUs);
+            putEndpoint(out, client.addr);
+            out.put(client.assignment);
+            out.put(client.expected);
+        });
+
+        out.put((uint64_t)shard.mailbox.size());
+        for (const Datagram &packet : shard.mailbox) {
+            out.put((uint32_t)packet.listener);
+            out.put((uint32_t)packet.addrLen);
+            putEndpoint(out, packet.addr);
+            out.put((uint64_t)packet.length);
+            out.put(packet.data, packet.length);
+        }
+    }
+    return out.data;
+}
+
+// Load a snapshot into freshly built shards; false if it does not fit them. Monotonic
+// timestamps are system-wide, so session deadlines carry over as they are.
+bool restoreSnapshot(const vector<char> &payload, size_t &sessions) {
+    HandoffReader in(payload);
+    in.get(secretKey, sizeof(secretKey));
+    sessions = 0;
+
+    for (int i = 0; i < workerCount; i++) {
+        ServerShard &shard = *shards[i];
+        uint64_t words = in.get<uint64_t>();
+        if (words > 2 * shard.activeClients.capacity() + 1) return false;
+        vector<uint32_t> slots(words);
+        in.get(slots.data(), slots.size() * sizeof(uint32_t));
+        if (!in.ok || !shard.activeClients.importSlots(slots)) return false;
+
+        uint64_t live = in.get<uint64_t>();
+        if (live != shard.activeClients.size()) return false;
+        for (uint64_t n = 0; n < live; n++) {
+            ClientData *client = shard.activeClients.adopt(in.get<uint32_t>());
+            if (!in.ok || client == nullptr) return false;
+            client->lastActivityUs = in.get<uint64_t>();
+            client->addr = getEndpoint(in);
+            in.get(&client->assignment, sizeof(client->assignment));
+            in.get(&client->expected, sizeof(client->expected));
+            shard.expiryWheel.schedule(client->id, clientDeadline(*client));
+        }
+        liveSessions.fetch_add(live, memory_order_relaxed);
+        sessions += live;
+
+        uint64_t forwarded = in.get<uint64_t>();
+        for (uint64_t n = 0; n < forwarded && in.ok; n++) {
+            shard.mailbox.emplace_back();
+            Datagram &packet = shard.mailbox.back();
+            packet.listener = in.get<uint32_t>();
+            packet.addrLen = in.get<uint32_t>();
+            packet.addr = getEndpoint(in);
+            packet.length = in.get<uint64_t>();
+            if (packet.listener < 0 || (size_t)packet.listener >= shard.sockets.size() || packet.length > MAXBUFLEN) return false;
+            in.get(packet.data, packet.length);
+        }
+        if (!shard.mailbox.empty()) {
+            shard.mailboxPending.store(true, memory_order_relaxed);
+            uint64_t one = 1;
+            if (write(shard.wakeFD, &one, sizeof(one)) == -1) return false;
+        }
+    }
+    return in.ok && in.offset == payload.size();
+}
+
+// Every listen socket in the order main() opens them: by shard, by address, UDP before TCP
+vector<int> handoffSockets() {
+    vector<int> fds;
+    for (int i = 0; i < workerCount; i++) {
+        for (size_t a = 0; a < shards[i]->sockets.size(); a++) {
+            fds.push_back(shards[i]->sockets[a]);
+            if (!shards[i]->streamSockets.empty()) fds.push_back(shards[i]->streamSockets[a]);
+        }
+    }
+    return fds;
+}
+
+void usage(const char *progName) {
+    fprintf(stderr, "Usage: %s [-b batch] [-U] [-T] [-w workers] [-c sessions] [-P pool] [-D entries] [-S] [-a rate] [-B burst] [-p v4,v6] [-m sessions] [-d] [-M port] [-g seed] [-l level] [-s N] [-r N] [-i seconds] [-H path] <hostname:port> [hostname:port ...]\n", progName);
+    fprintf(stderr, "  -b batch    datagrams per recvmmsg/sendmmsg (default %d, 1 = per-packet recvfrom/sendto)\n", DEFAULT_BATCH_SIZE);
+    fprintf(stderr, "  -U          io_uring backend: multishot recvmsg into provided buffers, batched sends\n");
+    fprintf(stderr, "  -T          also accept TCP (protocol 6) on every address, with the socket backend\n");
+    fprintf(stderr, "  -w workers  worker threads, each with its own SO_REUSEPORT socket (default 1, max %d)\n", MAX_WORKERS);
+    fprintf(stderr, "  -c sessions outstanding assignments each worker can hold (default %d)\n", DEFAULT_SESSION_CAPACITY);
+    fprintf(stderr, "  -P pool     pre-encoded assignments each worker keeps ready (default %d)\n", DEFAULT_POOL_SIZE);
+    fprintf(stderr, "  -D entries  finished sessions each worker remembers to repeat verdicts to retransmitted answers,\n");
+    fprintf(stderr, "              0 disables (default %d)\n", DEFAULT_REPLY_CACHE);
+    fprintf(stderr, "  -S          stateless: assignment IDs are signed cookies, no session table\n");
+    fprintf(stderr, "  -a rate     handshakes per second accepted from one source prefix (default unlimited)\n");
+    fprintf(stderr, "  -B burst    handshakes a source may send back to back (default: rate)\n");
+    fprintf(stderr, "  -p v4,v6    prefix lengths that make up one source for -a (default 32,64)\n");
+    fprintf(stderr, "  -m sessions outstanding assignments over all workers (default: workers * -c)\n");
+    fprintf(stderr, "  -d          drop refused handshakes silently instead of answering NOT OK\n");
+    fprintf(stderr, "  -M port     serve Prometheus metrics over HTTP on 127.0.0.1:port\n");
+    fprintf(stderr, "  -g seed     fixed seed for assignment generation, worker i uses seed + i (default: clock)\n");
+    fprintf(stderr, "  -l level    error, warn, info or debug (default info, debug when run as serverD)\n");
+    fprintf(stderr, "  -s N        log only 1 of every N occurrences of each event\n");
+    fprintf(stderr, "  -r N        log at most N lines per second per event and worker\n");
+    fprintf(stderr, "  -i seconds  log a traffic summary at this interval\n");
+    fprintf(stderr, "  -H path     hot restart: take over the sockets and sessions of the server listening at\n");
+    fprintf(stderr, "              this Unix socket path, if there is one, then listen there for the next one;\n");
+    fprintf(stderr, "              open TCP connections are not handed over, the old server closes them when it exits\n");
+    fprintf(stderr, "Every address argument is served by all workers: host:port, [IPv6]:port, or *:port for all local addresses.\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int batchSize = DEFAULT_BATCH_SIZE;
+    long sessionCapacity = DEFAULT_SESSION_CAPACITY;
+    long poolSize = DEFAULT_POOL_SIZE;
+    long replyCacheSize = DEFAULT_REPLY_CACHE;
+
+    uint32_t sampleEvery = 0, perSecond = 0;
+    unsigned int seed = 0;
+    uint32_t admitBurst = 0;
+    int metricsPort = 0;
+    int statsInterval = 0;
+    bool useUring = false;
+    bool useStreams = false;
+    bool seeded = false;
+    const char *handoffPath = NULL;
+    int opt;
+
+    // serverD is the same binary, it just starts at the verbose level
+    if (strcmp(basename(argv[0]), "serverD") == 0) {
+        logLevel = LOG_DEBUG;
+    }
+
+    while ((opt = getopt(argc, argv, "b:UTw:c:P:D:Sa:B:p:m:dM:g:l:s:r:i:H:")) != -1) {
+        switch (opt) {
+        case 'P':
+            poolSize = atol(optarg);
+            if (poolSize < 1) {
+                fprintf(stderr, "Error: pool size must be at least 1.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'D':
+            replyCacheSize = atol(optarg);
+            if (replyCacheSize < 0) {
+                fprintf(stderr, "Error: reply cache size cannot be negative.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'S':
+            statelessMode = true;
+            break;
+        case 'a':
+            admitRate = strtoul(optarg, NULL, 10);
+            break;
+        case 'B':
+            admitBurst = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            if (sscanf(optarg, "%d,%d", &admitPrefixV4, &admitPrefixV6) != 2 ||
+                admitPrefixV4 < 0 || admitPrefixV4 > 32 || admitPrefixV6 < 0 || admitPrefixV6 > 128) {
+                fprintf(stderr, "Error: prefix lengths must be given as v4,v6 (0-32, 0-128).\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'm':
+            sessionLimit = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            dropRejected = true;
+            break;
+        case 'U':
+            useUring = true;
+            break;
+        case 'T':
+            useStreams = true;
+            break;
+        case 'M':
+            metricsPort = atoi(optarg);
+            break;
+        case 'g':
+            seed = strtoul(optarg, NULL, 10);
+            seeded = true;
+            break;
+        case 'l':
+            logLevel = logParseLevel(optarg);
+            if (logLevel < 0) {
+                fprintf(stderr, "Error: unknown log level '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
             }
+            break;
+        case 's':
+            sampleEvery = atoi(optarg);
+            break;
+        case 'r':
+            perSecond = atoi(optarg);
+            break;
+        case 'i':
+            statsInterval = atoi(optarg);
+            break;
+        case 'H':
+            handoffPath = optarg;
+            break;
+        case 'b':
+            batchSize = atoi(optarg);
+            if (batchSize < 1 || batchSize > MAX_BATCH_SIZE) {
+                fprintf(stderr, "Error: batch size must be between 1 and %d.\n", MAX_BATCH_SIZE);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'c':
+            sessionCapacity = atol(optarg);
+            if (sessionCapacity < 1 || (size_t)sessionCapacity > SlotArena<ClientData>::maxCapacity(SHARD_ID_SHIFT)) {
+                fprintf(stderr, "Error: session capacity must be between 1 and %zu.\n", SlotArena<ClientData>::maxCapacity(SHARD_ID_SHIFT));
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'w':
+            workerCount = atoi(optarg);
+            if (workerCount < 1 || workerCount > MAX_WORKERS) {
+                fprintf(stderr, "Error: worker count must be between 1 and %d.\n", MAX_WORKERS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
 
-            activeClients[nextClientID] = ClientData(nextClientID, clientIP, clientPort, newTask);
+    if (optind == argc || statsInterval < 0) {
+        usage(argv[0]);
+    }
+    if (useStreams && useUring) {
+        fprintf(stderr, "Error: TCP (-T) is served by the socket backend, it cannot be combined with -U.\n");
+        exit(EXIT_FAILURE);
+    }
 
-            if (sendto(serverSocket, &newTask, sizeof(newTask), 0, (struct sockaddr *)&clientAddr, addrLen) == -1) {
-                perror("sendto");
-            } else {
-                printf("Sent calculation task to client %d\n", nextClientID);
-                nextClientID++;
+    logOverrideLimits(sampleEvery, perSecond);
+
+    printf("Starting server...\n");
+
+    encodeVerdicts();
+
+    if (getrandom(secretKey, sizeof(secretKey), 0) != sizeof(secretKey)) {
+        perror("getrandom");
+        exit(EXIT_FAILURE);
+    }
+
+    // Each worker sees its share of a source's handshakes, so it refills at its share of the rate
+    uint32_t shardRate = 0, shardBurst = 0;
+    if (admitRate > 0) {
+        if (admitBurst == 0) admitBurst = admitRate;
+        shardRate = admitRate / workerCount > 0 ? admitRate / workerCount : 1;
+        shardBurst = admitBurst / workerCount > 0 ? admitBurst / workerCount : 1;
+    }
+
+    vector<ListenAddress> listenAddresses;
+    for (int i = optind; i < argc; i++) {
+        if (!resolveListenAddress(argv[i], listenAddresses)) exit(EXIT_FAILURE);
+    }
+
+    // Everything but the sockets first, so a takeover (-H) keeps the old server waiting as briefly as possible
+    for (int i = 0; i < workerCount; i++) {
+        ServerShard *shard = new ServerShard(i, sessionCapacity, poolSize, replyCacheSize, shardRate, shardBurst);
+        if (seeded) {
+            initCalcRng_seed(&shard->rng, seed + i);
+        } else {
+            initCalcRng(&shard->rng);
+        }
+        shard->pool.refill(&shard->rng);
+        shard->wakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (shard->wakeFD == -1) {
+            perror("eventfd");
+            exit(EXIT_FAILURE);
+        }
+        shards[i] = shard;
+        metricsRegister(i, &shard->metrics);
+    }
+
+    if (useUring) {
+        Uring probe;
+        if (!probe.init(8, 16) || !probe.setupBuffers(0, 2, 64)) {
+            fprintf(stderr, "io_uring unavailable (%s), using the socket API.\n", strerror(errno));
+            useUring = false;
+        }
+    }
+
+    // -H: a server already listening at the path hands over its sockets instead of us opening new ones
+    int predecessor = -1;
+    vector<int> inherited;
+    vector<char> snapshot;
+    if (handoffPath != NULL) {
+        predecessor = handoffConnect(handoffPath);
+        if (predecessor == -1 && errno != ENOENT && errno != ECONNREFUSED) {
+            perror("handoff connect");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (predecessor != -1) {
+        printf("Taking over from the server at %s\n", handoffPath);
+        vector<char> layout = handoffLayout(listenAddresses.size(), useStreams, sessionCapacity);
+        vector<char> reply;
+        if (!handoffSend(predecessor, vector<int>(), layout) || !handoffReceive(predecessor, inherited, reply)) {
+            perror("handoff");
+            exit(EXIT_FAILURE);
+        }
+        if (reply != layout) { // Empty when refused
+            fprintf(stderr, "Error: the server at %s runs with other workers, addresses, -T or -c.\n", handoffPath);
+            exit(EXIT_FAILURE);
+        }
+        // Ready: the old server stops its workers now and sends everything once they have drained
+        if (!handoffBlocking(predecessor, HANDOFF_DRAIN_TIMEOUT_SEC) || !handoffSend(predecessor, vector<int>(), vector<char>()) ||
+            !handoffReceive(predecessor, inherited, snapshot) || snapshot.empty()) {
+            perror("handoff");
+            exit(EXIT_FAILURE);
+        }
+        if (inherited.size() != workerCount * listenAddresses.size() * (useStreams ? 2 : 1)) {
+            fprintf(stderr, "Error: expected %zu sockets from %s, got %zu.\n", workerCount * listenAddresses.size() * (useStreams ? 2 : 1),
+                    handoffPath, inherited.size());
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    size_t nextInherited = 0;
+    for (int i = 0; i < workerCount; i++) {
+        for (const ListenAddress &address : listenAddresses) {
+            int socketFD = predecessor != -1 ? inherited[nextInherited++] : openServerSocket(address, workerCount > 1, SOCK_DGRAM);
+            if (socketFD == -1) {
+                fprintf(stderr, "Failed to bind socket to %s.\n", endpointText(address.addr).text);
+                exit(EXIT_FAILURE);
             }
-        } else if (receivedBytes == sizeof(calcProtocol)) {
-            struct calcProtocol clientResponse;
-            memcpy(&clientResponse, buffer, sizeof(clientResponse));
+            shards[i]->sockets.push_back(socketFD);
+            if (!useStreams) continue;
 
-            int clientID = ntohl(clientResponse.id);
+            socketFD = predecessor != -1 ? inherited[nextInherited++] : openServerSocket(address, workerCount > 1, SOCK_STREAM);
+            if (socketFD == -1) {
+                fprintf(stderr, "Failed to bind TCP socket to %s.\n", endpointText(address.addr).text);
+                exit(EXIT_FAILURE);
+            }
+            shards[i]->streamSockets.push_back(socketFD);
+        }
+    }
 
-            if (activeClients.find(clientID) == activeClients.end()) {
-                sendResponse(serverSocket, clientAddr, addrLen, RESPONSE_NOT_OK);
-                printf("Client %s:%d with invalid ID %d tried to respond.\n", clientIP, clientPort, clientID);
-                continue;
+    int handoffListener = -1;
+    if (predecessor != -1) {
+        size_t sessions;
+        if (!restoreSnapshot(snapshot, sessions)) {
+            fprintf(stderr, "Error: malformed snapshot from %s.\n", handoffPath);
+            exit(EXIT_FAILURE);
+        }
+        // Taken: the old server exits, without this it serves on
+        if (!handoffSend(predecessor, vector<int>(), vector<char>())) {
+            perror("handoff");
+            exit(EXIT_FAILURE);
+        }
+        close(predecessor);
+        printf("Took over %zu sockets and %zu sessions.\n", inherited.size(), sessions);
+    }
+    if (handoffPath != NULL) {
+        handoffListener = handoffListen(handoffPath);
+        if (handoffListener == -1) {
+            perror("handoff listen");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (const ListenAddress &address : listenAddresses) {
+        printf("Listening on %s%s\n", endpointText(address.addr).text, useStreams ? " (UDP and TCP)" : "");
+    }
+
+    printf("Server is ready (%s, batch size %d, %d worker%s).\n", useUring ? "io_uring" : "sockets",
+           batchSize, workerCount, workerCount == 1 ? "" : "s");
+    fflush(stdout);
+
+    // Shutdown signals are blocked in every thread and read from a signalfd by main alone,
+    // so they must be blocked before the first thread starts
+    sigset_t shutdownSignals;
+    sigemptyset(&shutdownSignals);
+    sigaddset(&shutdownSignals, SIGINT);
+    sigaddset(&shutdownSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &shutdownSignals, NULL);
+
+    logStart();
+
+    if (metricsPort > 0) {
+        metricsGauge("calc_sessions_active", "Outstanding assignments over all workers", []() {
+            return (double)liveSessions.load(memory_order_relaxed);
+        });
+        if (!metricsStart(metricsPort)) exit(EXIT_FAILURE);
+    }
+
+    vector<thread> workers;
+    auto startWorkers = [&workers, batchSize, useUring]() {
+        for (int i = 0; i < workerCount; i++) {
+            workers.emplace_back([i, batchSize, useUring]() {
+                if (useUring) {
+                    // Each worker creates its own ring, the kernel ties a single-issuer ring to its creator
+                    Uring ring;
+                    unsigned sqEntries = batchSize * 2 > 64 ? batchSize * 2 : 64;
+                    if (ring.init(sqEntries, URING_CQ_ENTRIES) && ring.setupBuffers(0, URING_BUFFERS, URING_BUFFER_SIZE)) {
+                        serveUring(*shards[i], batchSize, ring);
+                        return;
+                    }
+                    LOG(LOG_ERROR, EV_IO_ERROR, "worker %d: io_uring setup failed (%m), using the socket API", i);
+                }
+                serveReactor(*shards[i], batchSize);
+            });
+        }
+    };
+    auto stopWorkers = [&workers]() {
+        stopping.store(true, memory_order_release);
+        for (int i = 0; i < workerCount; i++) {
+            uint64_t one = 1;
+            if (write(shards[i]->wakeFD, &one, sizeof(one)) == -1) perror("write eventfd");
+        }
+        for (thread &worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+    };
+    startWorkers();
+
+    // Main thread: wait for a shutdown signal, logging the traffic summary meanwhile
+    Reactor control;
+    TrafficSummary summary;
+    bool controlReady = control.init() && control.addSignals(shutdownSignals, [&control](int signal) {
+        LOG(LOG_INFO, EV_LIFECYCLE, "Received %s, shutting down.", strsignal(signal));
+        control.stop();
+    }) != -1;
+    if (controlReady && statsInterval > 0) {
+        controlReady = control.addTimer(statsInterval * 1000, [&summary]() { summary.log(); }) != -1;
+    }
+
+    // -H: a new server that asks with the same layout and then says it is ready gets everything
+    // once the workers have stopped. Peers are read without blocking, so the workers go on
+    // serving while one connects.
+    struct HandoffPeer {
+        HandoffInbox inbox;
+        bool accepted = false; // Layout matched and sent back, waiting for the new server to be ready
+        uint64_t deadlineMs; // Dropped if its next message has not arrived by then
+    };
+    unordered_map<int, HandoffPeer> peers;
+    int successor = -1;
+    vector<char> layout = handoffLayout(listenAddresses.size(), useStreams, sessionCapacity);
+    auto dropPeer = [&control, &peers](int peer) {
+        control.unwatch(peer);
+        close(peer);
+        peers.erase(peer);
+    };
+    auto readPeer = [&control, &peers, &successor, &layout, &dropPeer](int peer) {
+        HandoffPeer &state = peers[peer];
+        while (!state.accepted) {
+            int status = state.inbox.receive(peer, 0, layout.size());
+            if (status == 0) return;
+            if (status == -1 || state.inbox.payload != layout) {
+                LOG(LOG_WARN, EV_LIFECYCLE, "Refused a handoff: %s", status == 1 ? "the new server has another layout" : strerror(errno));
+                handoffSend(peer, vector<int>(), vector<char>()); // An empty reply means refused
+                dropPeer(peer);
+                return;
+            }
+            if (!handoffSend(peer, vector<int>(), layout)) { // A few bytes on a fresh socket, they fit its buffer
+                LOG(LOG_WARN, EV_LIFECYCLE, "Refused a handoff: %m");
+                dropPeer(peer);
+                return;
             }
+            state.accepted = true;
+            state.inbox.reset();
+            state.deadlineMs = monotonicMs() + HANDOFF_TIMEOUT_SEC * 1000;
+        }
 
-            ClientData &client = activeClients[clientID];
-            if (client.ipAddress != clientIP || client.portNumber != clientPort) {
-                sendResponse(serverSocket, clientAddr, addrLen, RESPONSE_NOT_OK);
-                printf("Client %s:%d tried to spoof ID %d.\n", clientIP, clientPort, clientID);
-                continue;
+        int status = state.inbox.receive(peer, 0, 0);
+        if (status == 0) return;
+        if (status == -1) {
+            LOG(LOG_WARN, EV_LIFECYCLE, "Handoff abandoned: %m");
+            dropPeer(peer);
+            return;
+        }
+        LOG(LOG_INFO, EV_LIFECYCLE, "Handing over to a new server process.");
+        control.unwatch(peer);
+        peers.erase(peer);
+        successor = peer;
+        control.stop();
+    };
+    if (controlReady && handoffListener != -1) {
+        controlReady = control.watch(handoffListener, EPOLLIN, [&control, &peers, &successor, &readPeer, handoffListener](uint32_t) {
+            int peer;
+            while (successor == -1 && (peer = handoffAccept(handoffListener)) != -1) {
+                peers[peer].deadlineMs = monotonicMs() + HANDOFF_TIMEOUT_SEC * 1000;
+                if (!control.watch(peer, EPOLLIN, [&readPeer, peer](uint32_t) {
+                        readPeer(peer);
+                        return false;
+                    })) {
+                    close(peer);
+                    peers.erase(peer);
+                }
+            }
+            return false;
+        });
+    }
+    if (controlReady && handoffListener != -1) {
+        controlReady = control.addTimer(1000, [&peers, &dropPeer]() {
+            vector<int> stale;
+            for (auto &entry : peers) {
+                if (entry.second.deadlineMs <= monotonicMs()) stale.push_back(entry.first);
             }
+            for (int peer : stale) {
+                LOG(LOG_WARN, EV_LIFECYCLE, "Handoff abandoned: the new server did not answer in time");
+                dropPeer(peer);
+            }
+        }) != -1;
+    }
+    if (!controlReady) {
+        perror("control loop");
+        exit(EXIT_FAILURE);
+    }
+    bool handedOver = false;
+    while (true) {
+        control.run();
+        stopWorkers();
+        metricsStop();
+        if (successor == -1) break;
+
+        // The sockets stay ours until the new server confirms it has taken them
+        vector<int> fds;
+        vector<char> taken;
+        handedOver = handoffBlocking(successor, HANDOFF_TIMEOUT_SEC) && handoffSend(successor, handoffSockets(), handoffSnapshot()) &&
+                     handoffReceive(successor, fds, taken);
+        int error = errno;
+        for (int fd : fds) close(fd);
+        close(successor);
+        successor = -1;
+        if (handedOver) {
+            LOG(LOG_INFO, EV_LIFECYCLE, "Handed over %zu sessions.", liveSessions.load(memory_order_relaxed));
+            break;
+        }
 
-            printf("Valid response from client %d (%s:%d)\n", clientID, client.ipAddress.c_str(), client.portNumber);
-            sendResponse(serverSocket, clientAddr, addrLen, RESPONSE_OK);
-            activeClients.erase(clientID);
+        LOG(LOG_ERROR, EV_LIFECYCLE, "Handoff failed (%s), serving on.", strerror(error));
+        stopping.store(false, memory_order_release);
+        if (metricsPort > 0 && !metricsStart(metricsPort)) LOG(LOG_ERROR, EV_LIFECYCLE, "Metrics endpoint not restarted.");
+        startWorkers();
+        for (int i = 0; i < workerCount; i++) {
+            uint64_t one = 1; // Answers forwarded while the workers were stopped wait in the mailboxes
+            if (write(shards[i]->wakeFD, &one, sizeof(one)) == -1) perror("write eventfd");
         }
     }
+    for (auto &entry : peers) close(entry.first);
+    if (!handedOver && handoffListener != -1) unlink(handoffPath);
+    if (handoffListener != -1) close(handoffListener);
+    logStop();
 
-    close(serverSocket);
+    for (int i = 0; i < workerCount; i++) {
+        for (int socketFD : shards[i]->sockets) close(socketFD);
+        for (int socketFD : shards[i]->streamSockets) close(socketFD);
+        for (StreamConnection *conn : shards[i]->streams) {
+            close(conn->fd);
+            delete conn;
+        }
+        close(shards[i]->wakeFD);
+        delete shards[i];
+    }
+    printf("Server stopped.\n");
     return 0;
 }
@@ -0,0 +1,64 @@
+#ifndef __SIPHASH
+#define __SIPHASH
+
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+
+/*
+   SipHash-2-4 (Aumasson & Bernstein), a keyed 64-bit MAC for short inputs.
+   Used by the server's stateless mode to sign assignment IDs.
+*/
+
+#define SIPHASH_KEY_SIZE 16
+
+static inline uint64_t sipRotl(uint64_t x, int b) {
+    return (x << b) | (x >> (64 - b));
+}
+
+#define SIP_ROUND(v0, v1, v2, v3)                                           \
+    do {                                                                    \
+        v0 += v1; v1 = sipRotl(v1, 13); v1 ^= v0; v0 = sipRotl(v0, 32);     \
+        v2 += v3; v3 = sipRotl(v3, 16); v3 ^= v2;                           \
+        v0 += v3; v3 = sipRotl(v3, 21); v3 ^= v0;                           \
+        v2 += v1; v1 = sipRotl(v1, 17); v1 ^= v2; v2 = sipRotl(v2, 32);     \
+    } while (0)
+
+static inline uint64_t siphash24(const uint8_t key[SIPHASH_KEY_SIZE], const void *data, size_t length) {
+    const uint8_t *in = (const uint8_t *)data;
+    uint64_t k0, k1, m;
+    memcpy(&k0, key, 8);
+    memcpy(&k1, key + 8, 8);
+
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+    size_t whole = length & ~(size_t)7;
+    for (size_t i = 0; i < whole; i += 8) {
+        memcpy(&m, in + i, 8); // Little endian hosts only, like the rest of the protocol code
+        v3 ^= m;
+        SIP_ROUND(v0, v1, v2, v3);
+        SIP_ROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    uint64_t last = (uint64_t)length << 56;
+    for (size_t i = 0; i < (length & 7); i++) {
+        last |= (uint64_t)in[whole + i] << (8 * i);
+    }
+    v3 ^= last;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= last;
+
+    v2 ^= 0xff;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#endif
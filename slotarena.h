@@ -0,0 +1,138 @@
+#ifndef __SLOT_ARENA
+#define __SLOT_ARENA
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/*
+   Fixed-capacity session store that also issues the session IDs.
+
+   Records are plain structs kept densely in one preallocated array; each has a
+   uint32_t id field, 0 while the slot is free. An ID is built from the slot index and
+   that slot's generation, which goes up every time the slot is released:
+
+       id = idBase | generation << indexBits | index
+
+   so find() is one array access plus a compare, and an ID from an earlier occupant of
+   the slot (a late or duplicated answer, a stale timer entry) no longer matches. Free
+   slots are reused in FIFO order from a ring, so a slot comes back only after all the
+   others have been used, and its generation only wraps after 2^idBits allocations.
+   Generations skip 0, so no ID is ever 0, even with idBase 0.
+
+   Nothing is allocated after construction. Pointers stay valid until the record is
+   released.
+
+   For a hot restart the arena moves to the next process in two parts: exportSlots()
+   gives the bookkeeping (every slot's generation and the free ring in order) and
+   forEach() the live records. An arena of the same capacity and ID layout takes the
+   bookkeeping with importSlots() and then gets each record back with adopt(), so IDs
+   already handed out stay valid and the next ones continue where the old process was.
+*/
+
+#define SLOT_MIN_GENERATION_BITS 4
+
+template <typename Record>
+class SlotArena {
+public:
+    // idBits low bits of every ID come from the arena, the bits above them from idBase
+    SlotArena(size_t capacity, uint32_t idBase, int idBits)
+        : records(capacity), generations(capacity, 1), freeRing(capacity), freeHead(0), freeCount(capacity),
+          base(idBase), count(0) {
+        indexBits = 0;
+        while (((size_t)1 << indexBits) < capacity) indexBits++;
+        generationMask = (1u << (idBits - indexBits)) - 1;
+        for (size_t i = 0; i < capacity; i++) freeRing[i] = i;
+    }
+
+    // Largest capacity that still leaves SLOT_MIN_GENERATION_BITS of generation in an ID
+    static size_t maxCapacity(int idBits) { return (size_t)1 << (idBits - SLOT_MIN_GENERATION_BITS); }
+
+    // Claim a free slot and give its record a fresh ID; nullptr when every slot is in use
+    Record *allocate() {
+        if (freeCount == 0) return nullptr;
+        uint32_t index = freeRing[freeHead];
+        freeHead = (freeHead + 1) % freeRing.size();
+        freeCount--;
+        count++;
+
+        Record &record = records[index];
+        record = Record();
+        record.id = base | (generations[index] << indexBits) | index;
+        return &record;
+    }
+
+    Record *find(uint32_t id) {
+        uint32_t index = id & ((1u << indexBits) - 1);
+        if (id == 0 || index >= records.size() || records[index].id != id) return nullptr;
+        return &records[index];
+    }
+
+    void release(Record *record) {
+        uint32_t index = record - records.data();
+        record->id = 0;
+        uint32_t generation = (generations[index] + 1) & generationMask;
+        generations[index] = generation ? generation : 1;
+
+        freeRing[(freeHead + freeCount) % freeRing.size()] = index;
+        freeCount++;
+        count--;
+    }
+
+    // Call visit(record) for every allocated record
+    template <typename Visit>
+    void forEach(Visit visit) const {
+        for (const Record &record : records) {
+            if (record.id != 0) visit(record);
+        }
+    }
+
+    // Generations, then the number of free slots and the free ring from its head
+    std::vector<uint32_t> exportSlots() const {
+        std::vector<uint32_t> words(generations);
+        words.push_back(freeCount);
+        for (size_t i = 0; i < freeCount; i++) words.push_back(freeRing[(freeHead + i) % freeRing.size()]);
+        return words;
+    }
+
+    // Only on a fresh arena; false if the words do not describe an arena of this capacity
+    bool importSlots(const std::vector<uint32_t> &words) {
+        size_t capacity = records.size();
+        if (words.size() < capacity + 1 || words[capacity] > capacity || words.size() != capacity + 1 + words[capacity]) return false;
+        for (size_t i = 0; i < capacity; i++) generations[i] = words[i];
+        freeCount = words[capacity];
+        freeHead = 0;
+        for (size_t i = 0; i < freeCount; i++) {
+            if (words[capacity + 1 + i] >= capacity) return false;
+            freeRing[i] = words[capacity + 1 + i];
+        }
+        count = capacity - freeCount;
+        return true;
+    }
+
+    // Record for an ID that was live in the exported arena, cleared apart from its id; nullptr
+    // if the ID does not belong to an occupied slot of the imported bookkeeping
+    Record *adopt(uint32_t id) {
+        uint32_t index = id & ((1u << indexBits) - 1);
+        if (index >= records.size() || records[index].id != 0 || id != (base | (generations[index] << indexBits) | index)) return nullptr;
+        Record &record = records[index];
+        record = Record();
+        record.id = id;
+        return &record;
+    }
+
+    size_t size() const { return count; }
+    size_t capacity() const { return records.size(); }
+
+private:
+    std::vector<Record> records;
+    std::vector<uint32_t> generations;
+    std::vector<uint32_t> freeRing; // Free slot indices, oldest release first
+    size_t freeHead, freeCount;
+    uint32_t base;
+    int indexBits;
+    uint32_t generationMask;
+    size_t count;
+};
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef __TEXT_PROTOCOL
+#define __TEXT_PROTOCOL
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <charconv>
+#include "protocol.h"
+
+/*
+   Text variant of the calc protocol (calcMessage.type 21/1), header-only.
+
+   The handshake is still a binary calcMessage, with type 21 instead of 22. Everything
+   after it is one ASCII line per datagram, fields separated by a single space:
+
+       server -> client   "<id> <op> <value1> <value2>\n"   e.g. "67108865 fadd 1.5 2.25\n"
+       client -> server   "<id> <result>\n"
+       server -> client   "OK\n" or "NOT OK\n"
+
+   <op> is the operator name from the arith mapping. Integer operators carry decimal
+   int32 values, float operators the shortest decimal that reads back to the same
+   double (std::to_chars), so a text client computes on exactly the operands the server
+   did. The newline is optional on input.
+
+   Parsing and formatting work in place on the datagram with std::from_chars and
+   std::to_chars: no locale, no sscanf/printf format parsing and nothing allocated.
+   Binary datagrams start with the high byte of a small type field, which is 0, and a
+   text line starts with a digit, so isTextDatagram() tells them apart from the first
+   byte alone.
+*/
+
+#define TEXT_LINE_MAX 96 // Longest line either side formats, newline included
+#define TEXT_NUMBER_MAX 24 // Longest number: "-2.2250738585072014e-308" is 24 characters
+
+// Operator name for an arith code, NULL if the code is reserved
+static inline const char *textArithName(uint32_t arith) {
+    static const char *const names[] = {"add", "sub", "mul", "div", "fadd", "fsub", "fmul", "fdiv"};
+    return (arith >= 1 && arith <= 8) ? names[arith - 1] : NULL;
+}
+
+static inline bool isTextDatagram(const char *data, size_t length) {
+    return length > 0 && data[0] >= '0' && data[0] <= '9';
+}
+
+// Read one number and step past it; false if there is none
+template <typename T>
+static inline bool textNumber(const char *&at, const char *end, T &value) {
+    std::from_chars_result result = std::from_chars(at, end, value);
+    if (result.ec != std::errc()) return false;
+    at = result.ptr;
+    return true;
+}
+
+static inline bool textSeparator(const char *&at, const char *end) {
+    if (at == end || *at != ' ') return false;
+    at++;
+    return true;
+}
+
+static inline bool textLineEnd(const char *at, const char *end) {
+    if (at != end && *at == '\n') at++;
+    return at == end;
+}
+
+// Three numbers and an operator name always fit in TEXT_LINE_MAX
+template <typename T>
+static inline char *textAppend(char *at, T value) {
+    return std::to_chars(at, at + TEXT_NUMBER_MAX, value).ptr;
+}
+
+static inline char *textAppend(char *at, const char *text) {
+    size_t length = strlen(text);
+    memcpy(at, text, length);
+    return at + length;
+}
+
+// Writes at most TEXT_LINE_MAX bytes and returns the length; 0 for a reserved operator
+static inline size_t formatTextAssignment(char *out, const calcProtocolHost &task) {
+    const char *name = textArithName(task.arith);
+    if (name == NULL) return 0;
+
+    char *at = out;
+    at = textAppend(at, task.id);
+    *at++ = ' ';
+    at = textAppend(at, name);
+    *at++ = ' ';
+    if (task.arith <= 4) {
+        at = textAppend(at, task.inValue1);
+        *at++ = ' ';
+        at = textAppend(at, task.inValue2);
+    } else {
+        at = textAppend(at, task.flValue1);
+        *at++ = ' ';
+        at = textAppend(at, task.flValue2);
+    }
+    *at++ = '\n';
+    return at - out;
+}
+
+// Fills id, arith and the operands of out; the other fields are left alone
+static inline bool parseTextAssignment(const char *data, size_t length, calcProtocolHost &out) {
+    const char *at = data, *end = data + length;
+    if (!textNumber(at, end, out.id) || !textSeparator(at, end)) return false;
+
+    const char *name = at;
+    while (at != end && *at != ' ') at++;
+    out.arith = 0;
+    for (uint32_t arith = 1; arith <= 8; arith++) {
+        const char *candidate = textArithName(arith);
+        if ((size_t)(at - name) == strlen(candidate) && memcmp(name, candidate, at - name) == 0) out.arith = arith;
+    }
+    if (out.arith == 0 || !textSeparator(at, end)) return false;
+
+    if (out.arith <= 4) {
+        if (!textNumber(at, end, out.inValue1) || !textSeparator(at, end) || !textNumber(at, end, out.inValue2)) return false;
+    } else {
+        if (!textNumber(at, end, out.flValue1) || !textSeparator(at, end) || !textNumber(at, end, out.flValue2)) return false;
+    }
+    return textLineEnd(at, end);
+}
+
+// The result goes out as an integer for arith 1-4 and as a double otherwise
+static inline size_t formatTextAnswer(char *out, uint32_t id, uint32_t arith, int32_t resultI, double resultD) {
+    char *at = out;
+    at = textAppend(at, id);
+    *at++ = ' ';
+    at = arith <= 4 ? textAppend(at, resultI) : textAppend(at, resultD);
+    *at++ = '\n';
+    return at - out;
+}
+
+// A parsed answer line. The reader knows the operator from the session, so the result
+// is kept both ways: integral is set only if the whole field is an int32.
+struct textAnswer {
+    uint32_t id;
+    bool integral;
+    int32_t resultI;
+    double resultD;
+};
+
+static inline bool parseTextAnswer(const char *data, size_t length, textAnswer &out) {
+    const char *at = data, *end = data + length;
+    if (!textNumber(at, end, out.id) || !textSeparator(at, end)) return false;
+
+    const char *result = at;
+    out.integral = textNumber(at, end, out.resultI) && textLineEnd(at, end);
+    at = result;
+    return textNumber(at, end, out.resultD) && textLineEnd(at, end);
+}
+
+static inline size_t formatTextVerdict(char *out, uint32_t message) {
+    return textAppend(out, message == 1 ? "OK\n" : "NOT OK\n") - out;
+}
+
+// calcMessage.message equivalent of a verdict line: 1 = OK, 2 = NOT OK, 0 if it is neither
+static inline uint32_t parseTextVerdict(const char *data, size_t length) {
+    const char *end = data + length;
+    if (length >= 2 && memcmp(data, "OK", 2) == 0 && textLineEnd(data + 2, end)) return 1;
+    if (length >= 6 && memcmp(data, "NOT OK", 6) == 0 && textLineEnd(data + 6, end)) return 2;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef __TIMER_WHEEL
+#define __TIMER_WHEEL
+
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+
+/*
+   Hashed timing wheel used by the server to expire idle clients.
+
+   Time is split into ticks of tickMs milliseconds and every tick maps onto one of
+   slotCount slots. schedule() drops an entry into the slot of its deadline and
+   expire() visits only the slots whose tick has fully elapsed, so each entry is
+   touched once when it fires instead of on every packet. Deadlines further away
+   than slotCount ticks simply stay in their slot for another rotation.
+
+   Entries are never removed early: when a client finishes or is refreshed, its old
+   entry stays in the wheel and the owner ignores it when it fires (the callback
+   gets the deadline it was scheduled with, to compare against the live one).
+*/
+
+// Milliseconds on the monotonic clock, the time base for all deadlines
+inline uint64_t monotonicMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Microseconds on the same clock, for latency measurements
+inline uint64_t monotonicUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+template <typename Key>
+class TimerWheel {
+public:
+    TimerWheel(uint64_t tickMs, size_t slotCount, uint64_t now)
+        : tickMs(tickMs), slots(slotCount), currentTick(now / tickMs), entries(0) {}
+
+    void schedule(const Key &key, uint64_t deadline) {
+        uint64_t tick = deadline / tickMs;
+        if (tick < currentTick) tick = currentTick; // Already due, fire on the next expire()
+        slots[tick % slots.size()].push_back(Entry{key, deadline});
+        entries++;
+    }
+
+    // Call onExpire(key, deadline) for every entry whose deadline has passed
+    template <typename Callback>
+    void expire(uint64_t now, Callback onExpire) {
+        uint64_t nowTick = now / tickMs;
+        if (nowTick - currentTick > slots.size()) {
+            currentTick = nowTick - slots.size(); // Idle for more than a rotation, visit each slot once
+        }
+
+        while (currentTick < nowTick) {
+            std::vector<Entry> &slot = slots[currentTick % slots.size()];
+            currentTick++;
+            if (slot.empty()) continue;
+
+            due.swap(slot);
+            for (const Entry &entry : due) {
+                if (entry.deadline <= now) {
+                    entries--;
+                    onExpire(entry.key, entry.deadline);
+                } else {
+                    slot.push_back(entry); // Belongs to a later rotation
+                }
+            }
+            due.clear();
+        }
+    }
+
+    // Milliseconds until the next occupied slot is due, -1 when the wheel is empty
+    int nextTimeout(uint64_t now) const {
+        if (entries == 0) return -1;
+
+        for (size_t i = 0; i < slots.size(); i++) {
+            if (!slots[(currentTick + i) % slots.size()].empty()) {
+                uint64_t due = (currentTick + i + 1) * tickMs;
+                return due > now ? (int)(due - now) : 0;
+            }
+        }
+        return -1;
+    }
+
+    size_t size() const { return entries; }
+
+private:
+    struct Entry {
+        Key key;
+        uint64_t deadline;
+    };
+
+    uint64_t tickMs;
+    std::vector<std::vector<Entry>> slots;
+    std::vector<Entry> due; // Scratch slot swapped in while expiring, keeps its capacity
+    uint64_t currentTick;   // First tick that has not been expired yet
+    size_t entries;
+};
+
+#endif
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+static int uringSetup(unsigned entries, io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags, const void *arg, size_t argSize) {
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+static int uringRegister(int fd, unsigned opcode, const void *arg, unsigned count) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+Uring::Uring()
+    : ringFD(-1), features(0), sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqRingSize(0), cqRingSize(0),
+      sqes((io_uring_sqe *)MAP_FAILED), sqesSize(0), sqEntries(0), sqLocalTail(0),
+      bufferRing((io_uring_buf_ring *)MAP_FAILED), bufferRingSize(0), bufferBase(nullptr),
+      bufferCount(0), bufferSize(0), bufferGroup(0), bufferTail(0) {}
+
+Uring::~Uring() {
+    if (bufferRing != MAP_FAILED) munmap(bufferRing, bufferRingSize);
+    free(bufferBase);
+    if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+    if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+    if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+    if (ringFD != -1) close(ringFD);
+}
+
+bool Uring::init(unsigned sqCount, unsigned cqCount) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = cqCount;
+
+    ringFD = uringSetup(sqCount, &params);
+    if (ringFD == -1 && errno == EINVAL) {
+        // Kernels before 6.1 lack the single-issuer flags, they only save some wakeups
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = cqCount;
+        ringFD = uringSetup(sqCount, &params);
+    }
+    if (ringFD == -1) return false;
+
+    features = params.features;
+    if (!(features & IORING_FEAT_EXT_ARG)) {
+        errno = ENOTSUP; // Waiting with a timeout needs IORING_ENTER_EXT_ARG (5.11)
+        return false;
+    }
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (features & IORING_FEAT_SINGLE_MMAP) {
+        if (cqRingSize > sqRingSize) sqRingSize = cqRingSize;
+        cqRingSize = sqRingSize;
+    }
+
+    sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFD, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) return false;
+
+    if (features & IORING_FEAT_SINGLE_MMAP) {
+        cqRing = sqRing;
+    } else {
+        cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFD, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) return false;
+    }
+
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe *)mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFD, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return false;
+
+    char *sq = (char *)sqRing, *cq = (char *)cqRing;
+    sqHead = (unsigned *)(sq + params.sq_off.head);
+    sqTail = (unsigned *)(sq + params.sq_off.tail);
+    sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    sqArray = (unsigned *)(sq + params.sq_off.array);
+    sqEntries = params.sq_entries;
+    sqLocalTail = *sqTail;
+
+    cqHead = (unsigned *)(cq + params.cq_off.head);
+    cqTail = (unsigned *)(cq + params.cq_off.tail);
+    cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // SQE i always sits in array slot i, so the indirection array is filled once
+    for (unsigned i = 0; i < sqEntries; i++) sqArray[i] = i;
+    return true;
+}
+
+bool Uring::setupBuffers(uint16_t group, unsigned count, unsigned size) {
+    if (count == 0 || (count & (count - 1)) != 0 || count > 32768) {
+        errno = EINVAL; // The kernel wants a power of two, and buffer IDs are 16 bits
+        return false;
+    }
+
+    bufferRingSize = count * sizeof(io_uring_buf);
+    bufferRing = (io_uring_buf_ring *)mmap(NULL, bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufferRing == MAP_FAILED) return false;
+
+    if (posix_memalign((void **)&bufferBase, 64, (size_t)count * size) != 0) {
+        bufferBase = nullptr;
+        errno = ENOMEM;
+        return false;
+    }
+
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)bufferRing;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (uringRegister(ringFD, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) return false;
+
+    bufferCount = count;
+    bufferSize = size;
+    bufferGroup = group;
+    bufferTail = 0;
+    for (unsigned i = 0; i < count; i++) recycleBuffer(i);
+    publishBuffers();
+    return true;
+}
+
+io_uring_sqe *Uring::nextSqe() {
+    unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    if (sqLocalTail - head >= sqEntries) return nullptr;
+
+    io_uring_sqe *sqe = &sqes[sqLocalTail & *sqMask];
+    sqLocalTail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int Uring::submitAndWait(int timeoutMs) {
+    unsigned toSubmit = sqLocalTail - *sqTail;
+    __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+
+    // GETEVENTS even when not waiting: deferred task work only runs inside such an enter
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    unsigned minComplete = timeoutMs != 0 ? 1 : 0;
+    io_uring_getevents_arg arg;
+    __kernel_timespec ts;
+    const void *argPtr = NULL;
+    size_t argSize = 0;
+
+    if (timeoutMs > 0) {
+        ts.tv_sec = timeoutMs / 1000;
+        ts.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+        memset(&arg, 0, sizeof(arg));
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+        argPtr = &arg;
+        argSize = sizeof(arg);
+    }
+
+    int submitted = uringEnter(ringFD, toSubmit, minComplete, flags, argPtr, argSize);
+    if (submitted == -1) {
+        if (errno == ETIME || errno == EINTR) return 0;
+        return -errno;
+    }
+    return submitted;
+}
+
+unsigned Uring::cqReady() const {
+    return __atomic_load_n(cqTail, __ATOMIC_ACQUIRE) - *cqHead;
+}
+
+io_uring_cqe *Uring::cqAt(unsigned i) const {
+    return &cqes[(*cqHead + i) & *cqMask];
+}
+
+void Uring::cqAdvance(unsigned count) {
+    __atomic_store_n(cqHead, *cqHead + count, __ATOMIC_RELEASE);
+}
+
+void Uring::recycleBuffer(uint16_t bufferID) {
+    // Index from the ring start: in C++ the header's flexible-array wrapper gets a one-byte
+    // empty struct in front of bufs[], which would shift every entry by eight bytes
+    io_uring_buf &entry = ((io_uring_buf *)bufferRing)[bufferTail & (bufferCount - 1)];
+    entry.addr = (uint64_t)(uintptr_t)buffer(bufferID);
+    entry.len = bufferSize;
+    entry.bid = bufferID;
+    bufferTail++;
+}
+
+void Uring::publishBuffers() {
+    __atomic_store_n(&bufferRing->tail, bufferTail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,70 @@
+#ifndef __URING_RING
+#define __URING_RING
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*
+   Minimal io_uring wrapper for the server's io_uring backend (-U), on raw syscalls so
+   the build needs only the kernel headers.
+
+   One ring per worker thread, used only by that thread: SQEs are filled with nextSqe()
+   and go to the kernel on the next submitAndWait(); completions are read in place with
+   cqReady()/cqAt() and released with cqAdvance(). A provided buffer ring lets multishot
+   receives pick their own buffers; the caller hands each one back with recycleBuffer()
+   once the datagram in it has been handled, and publishBuffers() makes the returned
+   buffers visible to the kernel in one store.
+*/
+
+class Uring {
+public:
+    Uring();
+    ~Uring();
+
+    // Map the rings; false with errno set if the kernel refuses (no io_uring, seccomp, ...)
+    bool init(unsigned sqEntries, unsigned cqEntries);
+
+    // Register bufferCount buffers of bufferSize bytes as provided buffer group `group`
+    bool setupBuffers(uint16_t group, unsigned bufferCount, unsigned bufferSize);
+
+    io_uring_sqe *nextSqe(); // nullptr when the submission queue is full
+
+    // Submit queued SQEs, then wait for at least one completion or timeoutMs (-1: no limit,
+    // 0: do not wait). Returns the number submitted or -errno; a timeout is not an error.
+    int submitAndWait(int timeoutMs);
+
+    unsigned cqReady() const;
+    io_uring_cqe *cqAt(unsigned i) const;
+    void cqAdvance(unsigned count);
+
+    char *buffer(uint16_t bufferID) const { return bufferBase + (size_t)bufferID * bufferSize; }
+    unsigned bufferLength() const { return bufferSize; }
+    void recycleBuffer(uint16_t bufferID);
+    void publishBuffers();
+
+private:
+    int ringFD;
+    unsigned features;
+
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize;
+    io_uring_sqe *sqes;
+    size_t sqesSize;
+
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned sqEntries;
+    unsigned sqLocalTail; // Filled but not yet published to the kernel
+
+    unsigned *cqHead, *cqTail, *cqMask;
+    io_uring_cqe *cqes;
+
+    io_uring_buf_ring *bufferRing;
+    size_t bufferRingSize;
+    char *bufferBase;
+    unsigned bufferCount, bufferSize;
+    uint16_t bufferGroup;
+    uint16_t bufferTail; // Local tail, published by publishBuffers()
+};
+
+#endif